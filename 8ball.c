@@ -8,10 +8,48 @@
 #include <linux/fs.h> 
 #include <linux/device.h>
 #include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/sched/signal.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/cpumask.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/kfifo.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/random.h>
+#include <linux/error-injection.h>
+#include <linux/refcount.h>
+#include <linux/user_namespace.h>
+#include <linux/cred.h>
+#include <net/genetlink.h>
+#include <net/sock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+#include <linux/io_uring/cmd.h>
+#else
+#include <linux/io_uring.h>
+#endif
+
+#include "8ball.h"
+
+#define CREATE_TRACE_POINTS
+#include "8ball_trace.h"
 
 #define DEV_NAME "8ball"
-#define MSG_LEN 80 /* Length of user message */
-#define NUM_CHOICES 10
+#define CHUNK_LEN 256 /* Question bytes copied in from the user at a time */
+#define FIFO_LEN 256 /* Answers a file can have queued up in line mode */
+#define BALL_MAX_DEVS 256 /* Minors reserved by register_chrdev */
 
 /* Driver prototypes */
 /* inode represents the underlying file, whereas file struct represents
@@ -23,224 +61,2777 @@
 static int device_open(struct inode *, struct file *);
 static int device_release(struct inode *, struct file *);
 /* Used to interact with the open fd */
-static ssize_t device_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t device_write(struct file *, const char __user *, size_t, loff_t *);
-
-static int major; 
-static struct class *cls;
-static struct file_operations fops = {
-	.read = device_read,
-	.write = device_write,
+static ssize_t device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t device_write_iter(struct kiocb *, struct iov_iter *);
+static long device_ioctl(struct file *, unsigned int, unsigned long);
+static int device_mmap(struct file *, struct vm_area_struct *);
+static __poll_t device_poll(struct file *, poll_table *);
+/* Tells netlink listeners the answers changed */
+static void ball_genl_notify(void);
+
+/* uring_cmd appeared in 5.19, and is only worth having with io_uring built in */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0) && IS_ENABLED(CONFIG_IO_URING)
+#define BALL_URING_CMD
+static int device_uring_cmd(struct io_uring_cmd *, unsigned int);
+#endif
+
+/* Driver wide state. Only written while loading/unloading the module, so it is
+ * kept away from anything that gets written while answering questions.
+ */
+struct ball_driver {
+	int major;
+	struct class *cls;
+	struct ball_dev __rcu **devs; /* Indexed by minor, NULL where there is none */
+	struct dentry *debugfs;
+	struct eightball_table *table; /* Mapped read-only by clients */
+	struct kmem_cache *file_cache; /* struct ball_file, one per open */
+};
+
+static struct ball_driver ball_drv __read_mostly;
+static DEFINE_MUTEX(ball_devs_lock); /* Serializes adding and removing devices */
+
+static const struct file_operations fops = {
+	.read_iter = device_read_iter,
+	.write_iter = device_write_iter,
+	/* splice/sendfile go through read_iter/write_iter on kernel pages, so
+	 * answers reach pipes and sockets without a trip through userspace
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.splice_write = iter_file_splice_write,
+	.unlocked_ioctl = device_ioctl,
+	.compat_ioctl = compat_ptr_ioctl, /* eightball_* structs are laid out the same for 32 bit */
+	.mmap = device_mmap,
+	.poll = device_poll,
+#ifdef BALL_URING_CMD
+	.uring_cmd = device_uring_cmd,
+#endif
 	.open = device_open,
 	.release = device_release,
 };
 
 /* Used to only allow one process to access the device at a time (only one can
- * open the device file)
+ * open the device file). Only enforced when the module is loaded with
+ * exclusive=1, otherwise any number of processes can hold the device open.
  */
 enum {
 	CDEV_NOT_USED = 0,
 	CDEV_USED = 1,
 };
 
-static char msg[MSG_LEN]; /* Hold the user's question */
-static atomic_t dev_open = ATOMIC_INIT(CDEV_NOT_USED); /* Is device open? */
+static unsigned int nr_devs;
+module_param(nr_devs, uint, 0444);
+MODULE_PARM_DESC(nr_devs, "Number of devices to create at load time (default: number of online CPUs)");
 
-/* Used to set device file permissions */
-static char *set_devnode(const struct device *dev, umode_t *mode){
-	/* When device is created, if we want to set perms, set to rw */
-	if (mode)
-		*mode = 0666;
-	
-	return NULL;
+static bool per_node;
+module_param(per_node, bool, 0444);
+MODULE_PARM_DESC(per_node, "Spread devices over NUMA nodes instead of CPUs, one per node by default (default: 0)");
+
+static bool random_answers;
+module_param(random_answers, bool, 0644);
+MODULE_PARM_DESC(random_answers, "New opens pick answers at random instead of from the question (default: 0)");
+
+static bool exclusive;
+module_param(exclusive, bool, 0444);
+MODULE_PARM_DESC(exclusive, "Only allow a single opener at a time (default: 0)");
+
+static bool exclusive_wait;
+module_param(exclusive_wait, bool, 0444);
+MODULE_PARM_DESC(exclusive_wait, "With exclusive=1, sleep until the device is free instead of failing with EBUSY (default: 0)");
+
+/* Everything the 8ball can say out of the box. Lengths are worked out at
+ * compile time, so handing out an answer is a table lookup plus one bounded
+ * copy.
+ */
+struct ball_answer {
+	const char *text;
+	size_t len;
+};
+
+#define BALL_ANSWER(str) { .text = str, .len = sizeof(str) - 1 }
+
+static const struct ball_answer answers[] = {
+	BALL_ANSWER("Yes.\n"),
+	BALL_ANSWER("Without a doubt.\n"),
+	BALL_ANSWER("You're better off not knowing.\n"),
+	BALL_ANSWER("YES YES YES!!!\n"),
+	BALL_ANSWER("Concentrate and ask again\n"),
+	BALL_ANSWER("No.\n"),
+	BALL_ANSWER("NO NO NO!!!\n"),
+	BALL_ANSWER("Not with that attitude.\n"),
+	BALL_ANSWER("That knowledge is kept even from me.\n"),
+	BALL_ANSWER("Signs point to yes.\n"),
+};
+
+#define NUM_CHOICES ARRAY_SIZE(answers)
+
+#define BALL_MAX_CHOICES 64 /* Most answers a set can have */
+#define BALL_ANSWER_MAX 128 /* Longest answer, its newline included */
+
+/* The answers in use. Starts out as the built-in ones above, and can be
+ * replaced at runtime through /sys/class/8ball/answers. Readers only look at
+ * it under rcu_read_lock(), so answering never waits on a replacement, and a
+ * replaced set is freed once every reader is done with it.
+ */
+struct ball_answer_set {
+	struct rcu_head rcu;
+	unsigned int nr;
+	u32 generation; /* Of the mapped table, once it holds this set */
+	struct ball_answer answers[]; /* Their texts are stored right after */
+};
+
+static struct ball_answer_set __rcu *ball_set;
+static DEFINE_MUTEX(ball_set_lock); /* Serializes replacing the set */
+
+/* Submission/completion rings shared with userspace (see 8ball.h). The kernel
+ * keeps its own copy of the indices it owns and of the layout, since userspace
+ * can scribble over the shared header at any time.
+ */
+struct ball_ring {
+	/* Separate from the file lock, which can be held while touching user
+	 * memory, whereas mmap comes in with the mmap lock already held
+	 */
+	struct mutex lock;
+	void *mem; /* vmalloc_user() area backing the mapping */
+	size_t size;
+	struct eightball_ring *hdr;
+	struct eightball_sqe *sqes;
+	struct eightball_cqe *cqes;
+	u32 entries;
+	u32 sq_head;
+	u32 cq_tail;
+};
+
+/* Usage counters of a device. Every CPU has its own copy, bumped without any
+ * locking or shared cache lines, and they are only added up when read through
+ * sysfs. Native words are used so the sums never see a torn counter.
+ */
+struct ball_stats {
+	unsigned long questions; /* Questions asked, however they came in */
+	unsigned long answers; /* Answers handed out in full */
+	unsigned long bytes_in;
+	unsigned long bytes_out;
+	unsigned long busy; /* Opens turned away with -EBUSY */
+	unsigned long faults; /* Calls failed with -EFAULT */
+	unsigned long throttled; /* Questions refused over the QPS limit */
+	unsigned long choices[BALL_MAX_CHOICES]; /* How often each answer was given */
+};
+
+/* One 8ball device (one minor, /dev/8ballN). Devices share nothing with each
+ * other and each starts on its own cache line, so workers pinned to different
+ * devices never bounce a line between them. Within a device, the fields set up
+ * at init are kept on a different line than the ones written on every
+ * open/release, so opens don't invalidate them for everybody else.
+ */
+struct ball_dev {
+	/* Read-mostly */
+	unsigned int minor;
+	unsigned int cpu; /* CPU whose workers should use this device */
+	int node; /* NUMA node of that CPU, where this state lives */
+	unsigned int mode; /* EIGHTBALL_MODE_* new opens start in */
+	unsigned int qps; /* Questions per second allowed, 0 for no limit */
+	struct user_namespace *owner; /* Only opened from within it, if set */
+	struct device *device;
+	struct ball_stats __percpu *stats;
+
+	/* Written on open/release */
+	atomic_t open ____cacheline_aligned_in_smp; /* Is device open? */
+	refcount_t ref; /* One for being reachable by minor, one per open fd */
+	wait_queue_head_t open_wq; /* Openers waiting for their turn */
+
+	/* Sum of the question last asked through a closed fd. New opens start from
+	 * it, so `echo question > /dev/8ball0; cat /dev/8ball0` still works across
+	 * two opens. Only touched on open/release, never on the read/write paths.
+	 */
+	unsigned int last_sum;
+
+	/* Written per question, only while there is a QPS limit. When the next
+	 * question is due (in ktime_get_ns() time) if they arrive evenly spaced.
+	 */
+	atomic64_t qps_due ____cacheline_aligned_in_smp;
+} ____cacheline_aligned_in_smp;
+
+
+/* State belonging to one open file (one struct file, hung off private_data).
+ * Every opener gets its own question, so concurrent clients never touch each
+ * other's data. The lock only serializes threads sharing the same fd.
+ *
+ * Questions are never stored: each chunk is folded into a running sum as it is
+ * written, so a question can be arbitrarily long and still only costs this
+ * much memory.
+ */
+struct ball_file {
+	struct ball_dev *dev;
+	struct mutex lock;
+	bool written; /* Did this file ask a question? */
+	bool answer_ready; /* Cleared once the answer was read up to EOF */
+	wait_queue_head_t wq; /* Readers waiting for the next question */
+	unsigned int decision; /* Index into answers, updated on every write */
+	u64 asked_ns; /* When the unanswered question was written, 0 once read */
+	unsigned int sum; /* Sum of the question bytes written so far */
+	unsigned int mode; /* EIGHTBALL_MODE_* */
+	unsigned int decide; /* EIGHTBALL_DECIDE_* */
+
+	/* Line mode: every '\n' written queues the answer to the line before it,
+	 * reads hand the queued answers out in order. A writev in single mode
+	 * queues one answer per segment the same way.
+	 */
+	unsigned int line_sum; /* Sum of the line written so far */
+	DECLARE_KFIFO(fifo, u8, FIFO_LEN); /* Queued answer indices */
+	bool line_partial; /* Is an answer half way out? */
+	unsigned int line_choice; /* Answer being read out */
+	size_t line_off; /* How much of it was read already */
+
+	struct ball_ring ring;
+};
+
+/* The decision path. Every interface answers through these, so a question
+ * maps to the same answer however it is asked.
+ */
+
+/* Word-at-a-time summing: the even and the odd bytes of each word are added
+ * into 16-bit lanes, so every word costs a load and a couple of ALU ops
+ * rather than one add per byte. A lane grows by at most 2 * 255 per word, so
+ * it is folded into the total every 128 words before it can overflow.
+ */
+#define BALL_SUM_LANES (~0UL / 0xffff * 0xff) /* 0x00ff00ff... */
+#define BALL_SUM_MAX_WORDS 128
+
+/* 8ball makes random choice depending on user input. Bytes are summed as
+ * unsigned so the result can't go negative on signed-char architectures. The
+ * result is exactly the plain byte-by-byte sum, just computed faster.
+ */
+static unsigned int ball_sum(const char *buf, size_t len)
+{
+	const u8 *bytes = (const u8 *)buf;
+	unsigned int sum = 0;
+
+	/* Bytes up to the first word boundary */
+	while(len && !IS_ALIGNED((unsigned long)bytes, sizeof(unsigned long))){
+		sum += *bytes++;
+		len--;
+	}
+
+	while(len >= sizeof(unsigned long)){
+		size_t words = min_t(size_t, len / sizeof(unsigned long), BALL_SUM_MAX_WORDS);
+		unsigned long lanes = 0;
+
+		len -= words * sizeof(unsigned long);
+
+		while(words--){
+			unsigned long word = *(const unsigned long *)bytes;
+
+			lanes += word & BALL_SUM_LANES;
+			lanes += (word >> 8) & BALL_SUM_LANES;
+			bytes += sizeof(unsigned long);
+		}
+
+		for(; lanes; lanes >>= 16)
+			sum += lanes & 0xffff;
+	}
+
+	/* Whatever is left after the last whole word */
+	while(len--)
+		sum += *bytes++;
+
+	return sum;
 }
 
-static int __init ball_init(void)
+/* Index into the answer set for a question whose bytes add up to sum.
+ *
+ * There is deliberately no cache of previous questions in front of this. Any
+ * key for one, however cheap the hash, has to read every byte of the question,
+ * which is all the byte sum does too, and a lookup could only add to that.
+ */
+static unsigned int ball_decide(unsigned int sum, unsigned int nr)
 {
-    /* Registers the device driver and adds its ID (major number) to /proc/devices */
-    major = register_chrdev(0, DEV_NAME, &fops);
+	return sum % nr;
+}
 
-    if(major < 0){
-        pr_alert("Failure registering device: %d\n", major);
-		class_destroy(cls);
-        return major;
-    }
+/* How many answers the set in use has */
+static unsigned int ball_nr_choices(void)
+{
+	unsigned int nr;
 
-    pr_info("Got device number %d!\n", major);
-	
-/* Similar physical devices are grouped up into device classes.
- * This class will expose the same interface for all these devices (to the userspace).
- * BUT the underlying implementation can vary depending on the driver used.
- * Multiple drivers can be used within a class for a varying amount of devices
+	rcu_read_lock();
+	nr = rcu_dereference(ball_set)->nr;
+	rcu_read_unlock();
+
+	return nr;
+}
+
+/* Copy out the text of an answer, so it can go to userspace outside of the RCU
+ * read side. The choice may have been made before the set got replaced, in
+ * which case it wraps around the new set. buf must hold BALL_ANSWER_MAX bytes.
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
-	cls = class_create(DEV_NAME);
-#else 
-	cls = class_create(THIS_MODULE, DEV_NAME);
+static size_t ball_get_answer(unsigned int choice, char *buf)
+{
+	const struct ball_answer_set *set;
+	const struct ball_answer *answer;
+	size_t len;
+
+	rcu_read_lock();
+
+	set = rcu_dereference(ball_set);
+	answer = &set->answers[choice % set->nr];
+	len = answer->len;
+	memcpy(buf, answer->text, len);
+
+	rcu_read_unlock();
+
+	return len;
+}
+
+/* A uniformly random index into the answer set. get_random_u32() draws from
+ * per-CPU batches, so answering this way never serializes on a shared lock.
+ */
+static unsigned int ball_decide_random(unsigned int nr)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+	return get_random_u32_below(nr);
+#else
+	return prandom_u32_max(nr);
 #endif
-	
-	cls->devnode = set_devnode;
+}
 
-	/* MKDEV is a macro that just bitshifts the major/minor values in an int.
-	 * This serves as the ID of this device (and why this macro is used for deletion)
-	*/
-	device_create(cls, NULL, MKDEV(major, 0), NULL, DEV_NAME);
+/* Policy hook for BPF. Every answer is chosen through here, so an fmod_ret
+ * program attached to it can pick answers its own way: returning the index
+ * of an answer plus one replaces choice, and returning 0 keeps it. The default
+ * does the same as a program happy with choice.
+ *
+ * The default ignores most of its arguments, so it is kept global, noinline
+ * and __noclone: otherwise the compiler may call a clone of it with those
+ * arguments dropped, and programs attached to the symbol would never run.
+ */
+int ball_decide_hook(unsigned int minor, unsigned int sum,
+		     unsigned int nr_choices, unsigned int choice);
 
-	/* Device file is created under /dev*/
-	pr_info("Created device on /dev/%s\n", DEV_NAME);
+noinline __noclone int ball_decide_hook(unsigned int minor, unsigned int sum,
+					unsigned int nr_choices, unsigned int choice)
+{
+	return choice + 1;
+}
+ALLOW_ERROR_INJECTION(ball_decide_hook, TRUE);
 
-    return 0;
+/* Answer a question on a device out of nr answers, at random or from its sum */
+static unsigned int ball_choose_nr(struct ball_dev *bd, unsigned int sum, unsigned int nr, bool random)
+{
+	unsigned int choice;
+	int ret;
+
+	if(random)
+		choice = ball_decide_random(nr);
+	else
+		choice = ball_decide(sum, nr);
+
+	/* An out of range pick from a policy is ignored */
+	ret = ball_decide_hook(bd->minor, sum, nr, choice);
+	if(ret > 0 && ret <= nr)
+		choice = ret - 1;
+
+	return choice;
 }
 
-static void __exit ball_exit(void)
+/* Same, out of the set in use */
+static unsigned int ball_choose(struct ball_dev *bd, unsigned int sum, bool random)
 {
-	/* Unregister driver */
-    unregister_chrdev(major, DEV_NAME);
-	
-	/* Unregister device */
-	device_destroy(cls, MKDEV(major, 0));
-	class_destroy(cls);
+	return ball_choose_nr(bd, sum, ball_nr_choices(), random);
+}
 
-    pr_alert("Removing device: %d\n", major);
+/* Answer a question for an fd, the way the fd wants its answers chosen */
+static unsigned int ball_decide_file(struct ball_file *bf, unsigned int sum)
+{
+	return ball_choose(bf->dev, sum, READ_ONCE(bf->decide) == EIGHTBALL_DECIDE_RANDOM);
 }
 
-/* Methods */
+/* Publish the answers in the table userspace can map read-only, bumping the
+ * generation around the update so clients can tell they raced with it. Called
+ * with ball_set_lock held.
+ */
+static int ball_table_publish(const struct ball_answer *set, unsigned int nr)
+{
+	struct eightball_table *t = ball_drv.table;
+	size_t off = struct_size(t, entries, nr);
+	unsigned int i;
+
+	if(off > EIGHTBALL_TABLE_SIZE)
+		return -ENOSPC;
+
+	for(i = 0; i < nr; i++){
+		if(set[i].len > EIGHTBALL_TABLE_SIZE - off)
+			return -ENOSPC;
+		off += set[i].len;
+	}
+
+	/* Odd while the table is being rewritten */
+	WRITE_ONCE(t->generation, t->generation + 1);
+	smp_wmb();
+
+	off = struct_size(t, entries, nr);
+	for(i = 0; i < nr; i++){
+		t->entries[i].off = off;
+		t->entries[i].len = set[i].len;
+		memcpy((char *)t + off, set[i].text, set[i].len);
+		off += set[i].len;
+	}
+	t->nr_choices = nr;
+
+	smp_wmb();
+	WRITE_ONCE(t->generation, t->generation + 1);
 
-/* Called when process opens device (creates new fd) */
-static int device_open(struct inode *, struct file *)
-{	
-	/* Performs atomic compare-and exchange:
-	 * 1. ptr to atomic variable (to modify)
-	 * 2. value you expect
-	 * 3. value you want to set
-	 * If curr value == expected, set to new. If not, do nothing
-	 * returns value of atomic variable
-	 * If this value is 0, this means we didn't modify (no access). 
-	 * If it is 1, we modified (have access)
-	 */
-	if(atomic_cmpxchg(&dev_open, CDEV_NOT_USED, CDEV_USED))
-		return -EBUSY; /* Device is currently busy */
-	
-	/* Increments a counter that represents how many devices are using this
-	 * device (used to prevent a rmmod when module is in use)
-	 */
-	try_module_get(THIS_MODULE);
 	return 0;
 }
 
-/* Called when process closes device file */
-static int device_release(struct inode *, struct file *)
+/* Allocate a set of nr answers, with room for len bytes of text after them */
+static struct ball_answer_set *ball_set_alloc(unsigned int nr, size_t len)
 {
-	/* Now ready for next caller */
-	atomic_set(&dev_open, CDEV_NOT_USED);
-	
-	/* Decrement usage count */
-	module_put(THIS_MODULE);
-	
+	struct ball_answer_set *set;
+
+	set = kzalloc(struct_size(set, answers, nr) + len, GFP_KERNEL);
+	if(set)
+		set->nr = nr;
+
+	return set;
+}
+
+/* Where the answer texts of a set are stored */
+static char *ball_set_text(struct ball_answer_set *set)
+{
+	return (char *)&set->answers[set->nr];
+}
+
+/* Make set the one in use, and in the mapped table. Takes ownership of set. */
+static int ball_set_replace(struct ball_answer_set *set)
+{
+	struct ball_answer_set *old = NULL;
+	int err;
+
+	mutex_lock(&ball_set_lock);
+
+	/* Refused if it doesn't fit the table, before anything changes */
+	err = ball_table_publish(set->answers, set->nr);
+	if(!err){
+		set->generation = ball_drv.table->generation;
+		old = rcu_replace_pointer(ball_set, set, lockdep_is_held(&ball_set_lock));
+	}
+
+	mutex_unlock(&ball_set_lock);
+
+	if(err){
+		kfree(set);
+		return err;
+	}
+
+	/* Readers still looking at the old set keep it alive until they're done */
+	if(old)
+		kfree_rcu(old, rcu);
+
 	return 0;
 }
 
-/* Called when a process, which already opened dev file, tries to read */
-static ssize_t device_read(struct file *filp, char __user *buffer, size_t length, loff_t *offset){
-	
-	int bytes_read = 0;
-	int decision = 0;
-	char *msg_ptr;
+/* Set up the mappable table and the built-in answer set */
+static int ball_answers_init(void)
+{
+	struct ball_answer_set *set;
+	size_t len = 0;
+	char *text;
+
+	/* Every set ball_set_parse accepts has to fit in the table */
+	BUILD_BUG_ON(sizeof(struct eightball_table) +
+		     BALL_MAX_CHOICES * (sizeof(struct eightball_table_entry) + BALL_ANSWER_MAX) >
+		     EIGHTBALL_TABLE_SIZE);
 
-	/* 8ball makes random choice depending on user input */
-	for(int i = 0; i < MSG_LEN; i++){
-		decision += msg[i];
+	/* Zeroed and safe to map to userspace */
+	ball_drv.table = vmalloc_user(EIGHTBALL_TABLE_SIZE);
+	if(!ball_drv.table)
+		return -ENOMEM;
+
+	for(unsigned int i = 0; i < NUM_CHOICES; i++)
+		len += answers[i].len;
+
+	set = ball_set_alloc(NUM_CHOICES, len);
+	if(!set)
+		return -ENOMEM;
+
+	text = ball_set_text(set);
+	for(unsigned int i = 0; i < NUM_CHOICES; i++){
+		memcpy(text, answers[i].text, answers[i].len);
+		set->answers[i] = (struct ball_answer){ .text = text, .len = answers[i].len };
+		text += answers[i].len;
 	}
 
-	decision %= NUM_CHOICES;
+	return ball_set_replace(set);
+}
 
-	switch(decision){
-		case 0:
-			msg_ptr = "Yes.\n";
-			break;
+/* Nobody can be reading the answers anymore by the time this runs */
+static void ball_answers_free(void)
+{
+	kfree(rcu_dereference_protected(ball_set, 1));
+	vfree(ball_drv.table);
+}
 
-		case 1:
-			msg_ptr = "Without a doubt.\n";
-			break;
+/* Same as ball_sum_user, for the iterators read_iter/write_iter are given */
+static ssize_t ball_sum_iter(struct iov_iter *from, size_t len, unsigned int *sum)
+{
+	char chunk[CHUNK_LEN];
+	size_t done = 0;
 
-		case 2:
-			msg_ptr = "You're better off not knowing.\n";
-			break;
+	*sum = 0;
 
-		case 3:
-			msg_ptr = "YES YES YES!!!\n";
-			break;
+	while(done < len){
+		size_t want = min_t(size_t, len - done, CHUNK_LEN);
+		/* copy_from_iter returns number of bytes that it could read from user */
+		size_t got = copy_from_iter(chunk, want, from);
 
-		case 4:
-			msg_ptr = "Concentrate and ask again\n";
-			break;
+		*sum += ball_sum(chunk, got);
+		done += got;
 
-		case 5:
-			msg_ptr = "No.\n";
+		if(got < want || fatal_signal_pending(current))
 			break;
 
-		case 6:
-			msg_ptr = "NO NO NO!!!\n";
-			break;
+		cond_resched();
+	}
 
-		case 7:
-			msg_ptr = "Not with that attitude.\n";
-			break;
+	if(len && !done)
+		return -EFAULT;
 
-		case 8:
-			msg_ptr = "That knowledge is kept even from me.\n";
-			break;
+	return done;
+}
+
+/* Sum a question straight out of userspace a chunk at a time, so it can be of
+ * any length without ever being held anywhere. Returns how many bytes were
+ * summed, which is only short of len if userspace faulted part way or we got
+ * killed, and -EFAULT if nothing could be read at all.
+ */
+static ssize_t ball_sum_user(const char __user *buf, size_t len, unsigned int *sum)
+{
+	char chunk[CHUNK_LEN];
+	size_t done = 0;
+
+	*sum = 0;
+
+	while(done < len){
+		size_t want = min_t(size_t, len - done, CHUNK_LEN);
+		/* copy_from_user returns number of bytes that it could *not* read from user */
+		size_t got = want - copy_from_user(chunk, buf + done, want);
 
-		case 9:
-			msg_ptr = "Signs point to yes.\n";
+		*sum += ball_sum(chunk, got);
+		done += got;
+
+		if(got < want || fatal_signal_pending(current))
 			break;
-	}
 
-	if(!*(msg_ptr + *offset)){ /* If we are at end of message already */
-		*offset = 0; /* Reset offset */
-		return 0; 
+		cond_resched();
 	}
 
-	msg_ptr += *offset; /* Set up to read starting from offset */
+	if(len && !done)
+		return -EFAULT;
 
-	while(length && *msg_ptr){ /* While user buffer has space && we have data to write */
-		put_user(*(msg_ptr++), buffer++);
-		length--;
-		bytes_read++;
-	}
+	return done;
+}
 
-	*offset += bytes_read;
-	return bytes_read;
+#define ball_stat_inc(bd, field) this_cpu_inc((bd)->stats->field)
+#define ball_stat_add(bd, field, n) this_cpu_add((bd)->stats->field, n)
+
+/* Account for an answer that went out in full */
+static void ball_stat_answer(struct ball_dev *bd, unsigned int choice)
+{
+	ball_stat_inc(bd, answers);
+	ball_stat_inc(bd, choices[choice]);
 }
 
-/* Called when a process tries to write to file */
-static ssize_t device_write(struct file *filep, const char __user *buffer, size_t length, loff_t *offset)
+/* Take a question off the device's QPS budget, in the style of a token bucket
+ * holding up to a second worth of questions. Returns true if it is over the
+ * limit and has to be refused. Without a limit, nothing is shared or written.
+ */
+static bool ball_throttle(struct ball_dev *bd, unsigned int n)
 {
+	unsigned int qps = READ_ONCE(bd->qps);
+	s64 now, due, next;
 
-	if(*offset >= MSG_LEN){ /* If buffer is full */
-		*offset = 0; /* Reset buffer ptr */
-		return 0;
-	}
+	if(!qps)
+		return false;
+
+	now = ktime_get_ns();
+	due = atomic64_read(&bd->qps_due);
+
+	do {
+		next = max(due, now) + div_u64((u64)n * NSEC_PER_SEC, qps);
+
+		if(next - now > NSEC_PER_SEC){
+			ball_stat_add(bd, throttled, n);
+			return true;
+		}
+	} while(!atomic64_try_cmpxchg(&bd->qps_due, &due, next));
+
+	return false;
+}
+
+/* Drop a reference to a device, freeing it once it is gone and unused */
+static void ball_dev_put(struct ball_dev *bd)
+{
+	if(!refcount_dec_and_test(&bd->ref))
+		return;
+
+	if(bd->owner)
+		put_user_ns(bd->owner);
+	free_percpu(bd->stats);
+	kfree(bd);
+}
+
+/* Look up a device by minor, taking a reference to it */
+static struct ball_dev *ball_dev_get(unsigned int minor)
+{
+	struct ball_dev *bd;
+
+	if(minor >= BALL_MAX_DEVS)
+		return NULL;
+
+	rcu_read_lock();
+
+	bd = rcu_dereference(ball_drv.devs[minor]);
+	if(bd && !refcount_inc_not_zero(&bd->ref))
+		bd = NULL;
+
+	rcu_read_unlock();
+
+	return bd;
+}
 
-	ssize_t len = min(length, (size_t)(MSG_LEN - *offset)); /* Read up to remaining buffer size */
+/* Devices made for a tenant can only be used from within its user namespace */
+static bool ball_dev_allowed(struct ball_dev *bd)
+{
+	return !bd->owner || current_in_userns(bd->owner);
+}
+
+/* Latency histograms, dumped through /sys/kernel/debug/8ball/. Bucket b counts
+ * the calls that took [2^(b-1), 2^b) ns, with the last bucket catching
+ * everything slower. Like the stats they are per-CPU and only summed on
+ * demand, so recording a sample is a single local increment.
+ */
+#define BALL_HIST_BUCKETS 32
+
+enum ball_hist {
+	BALL_HIST_READ, /* Time spent in device_read */
+	BALL_HIST_WRITE, /* Time spent in device_write */
+	BALL_HIST_ANSWER, /* Time from a write to the first read of its answer */
+	BALL_NR_HISTS,
+};
+
+static const char * const ball_hist_names[BALL_NR_HISTS] = {
+	[BALL_HIST_READ] = "read_ns",
+	[BALL_HIST_WRITE] = "write_ns",
+	[BALL_HIST_ANSWER] = "answer_ns",
+};
+
+struct ball_hists {
+	unsigned long buckets[BALL_NR_HISTS][BALL_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct ball_hists, ball_hists);
+
+static void ball_hist_record(enum ball_hist hist, u64 ns)
+{
+	unsigned int bucket = min_t(unsigned int, fls64(ns), BALL_HIST_BUCKETS - 1);
+
+	this_cpu_inc(ball_hists.buckets[hist][bucket]);
+}
+
+/* Used to set device file permissions */
+static char *set_devnode(const struct device *dev, umode_t *mode){
+	/* When device is created, if we want to set perms, set to rw */
+	if (mode)
+		*mode = 0666;
 	
-	/* Read question from user */
-	if(copy_from_user(msg + *offset, buffer, len))
-		/* copy_from_user returns number of bytes that it could *not* read from user */
-		return -EFAULT;
+	return NULL;
+}
 
-	*offset += len;
+/* Which CPU a device is meant for, shown as /sys/class/8ball/8ballN/cpu */
+static ssize_t cpu_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	struct ball_dev *bd = dev_get_drvdata(device);
 
-	return len; 
-	/* The return value represents how many bytes were read. For the userspace
-	 * write() call, it will keep trying until it sends all data 
-	 * (looping infinitely if you return 0)
-	 */
+	return sysfs_emit(buf, "%u\n", bd->cpu);
 }
+static DEVICE_ATTR_RO(cpu);
+
+/* NUMA node of that CPU, /sys/class/8ball/8ballN/node */
+static ssize_t node_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	struct ball_dev *bd = dev_get_drvdata(device);
+
+	return sysfs_emit(buf, "%d\n", bd->node);
+}
+static DEVICE_ATTR_RO(node);
+
+static const char * const ball_mode_names[] = {
+	[EIGHTBALL_MODE_SINGLE] = "single",
+	[EIGHTBALL_MODE_LINES] = "lines",
+};
+
+/* Mode new opens of the device start in, /sys/class/8ball/8ballN/mode. Lets
+ * plain shell redirections use line mode, as they can't issue the ioctl.
+ */
+static ssize_t mode_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	struct ball_dev *bd = dev_get_drvdata(device);
+
+	return sysfs_emit(buf, "%s\n", ball_mode_names[READ_ONCE(bd->mode)]);
+}
+
+static ssize_t mode_store(struct device *device, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct ball_dev *bd = dev_get_drvdata(device);
+	int mode = sysfs_match_string(ball_mode_names, buf);
+
+	if(mode < 0)
+		return mode;
+
+	WRITE_ONCE(bd->mode, mode);
+	return count;
+}
+static DEVICE_ATTR_RW(mode);
+
+/* Questions per second the device takes, /sys/class/8ball/8ballN/qps. 0 means
+ * no limit. Questions over it are refused with EBUSY.
+ */
+static ssize_t qps_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	struct ball_dev *bd = dev_get_drvdata(device);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(bd->qps));
+}
+
+static ssize_t qps_store(struct device *device, struct device_attribute *attr,
+			 const char *buf, size_t count)
+{
+	struct ball_dev *bd = dev_get_drvdata(device);
+	unsigned int qps;
+	int err;
+
+	err = kstrtouint(buf, 0, &qps);
+	if(err)
+		return err;
+
+	WRITE_ONCE(bd->qps, qps);
+	return count;
+}
+static DEVICE_ATTR_RW(qps);
+
+static struct attribute *ball_attrs[] = {
+	&dev_attr_cpu.attr,
+	&dev_attr_node.attr,
+	&dev_attr_mode.attr,
+	&dev_attr_qps.attr,
+	NULL,
+};
+
+static const struct attribute_group ball_group = {
+	.attrs = ball_attrs,
+};
+
+/* Add up one counter over every CPU */
+static unsigned long ball_stat_sum(struct ball_dev *bd, size_t offset)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += *(unsigned long *)((void *)per_cpu_ptr(bd->stats, cpu) + offset);
+
+	return sum;
+}
+
+/* Shown as /sys/class/8ball/8ballN/stats/<field> */
+#define BALL_STAT_ATTR(field)									\
+static ssize_t field##_show(struct device *device, struct device_attribute *attr, char *buf)	\
+{												\
+	struct ball_dev *bd = dev_get_drvdata(device);						\
+												\
+	return sysfs_emit(buf, "%lu\n", ball_stat_sum(bd, offsetof(struct ball_stats, field)));	\
+}												\
+static DEVICE_ATTR_RO(field)
+
+BALL_STAT_ATTR(questions);
+BALL_STAT_ATTR(answers);
+BALL_STAT_ATTR(bytes_in);
+BALL_STAT_ATTR(bytes_out);
+BALL_STAT_ATTR(busy);
+BALL_STAT_ATTR(faults);
+BALL_STAT_ATTR(throttled);
+
+/* How often each answer was given, in answer table order. Counts are kept by
+ * index, so they carry over when the answer set is replaced.
+ */
+static ssize_t choices_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	struct ball_dev *bd = dev_get_drvdata(device);
+	unsigned int nr = ball_nr_choices();
+	int len = 0;
+
+	for(unsigned int i = 0; i < nr; i++)
+		len += sysfs_emit_at(buf, len, "%lu%c",
+				     ball_stat_sum(bd, offsetof(struct ball_stats, choices) +
+						   i * sizeof(unsigned long)),
+				     i == nr - 1 ? '\n' : ' ');
+
+	return len;
+}
+static DEVICE_ATTR_RO(choices);
+
+static struct attribute *ball_stats_attrs[] = {
+	&dev_attr_questions.attr,
+	&dev_attr_answers.attr,
+	&dev_attr_bytes_in.attr,
+	&dev_attr_bytes_out.attr,
+	&dev_attr_busy.attr,
+	&dev_attr_faults.attr,
+	&dev_attr_throttled.attr,
+	&dev_attr_choices.attr,
+	NULL,
+};
+
+static const struct attribute_group ball_stats_group = {
+	.name = "stats",
+	.attrs = ball_stats_attrs,
+};
+
+static const struct attribute_group *ball_groups[] = {
+	&ball_group,
+	&ball_stats_group,
+	NULL,
+};
+
+/* Build an answer set out of text with one answer per line. Blank lines are
+ * skipped, and every answer keeps its newline.
+ */
+static struct ball_answer_set *ball_set_parse(const char *buf, size_t count)
+{
+	const char *p, *end = buf + count, *nl;
+	struct ball_answer_set *set;
+	unsigned int nr = 0, i = 0;
+	size_t len = 0;
+	char *text;
+
+	/* First count the answers and check they all fit */
+	for(p = buf; p < end; p = nl + 1){
+		size_t n;
+
+		nl = memchr(p, '\n', end - p) ?: end;
+		n = nl - p;
+
+		if(!n)
+			continue;
+		if(n + 1 > BALL_ANSWER_MAX || ++nr > BALL_MAX_CHOICES)
+			return ERR_PTR(-E2BIG);
+		len += n + 1;
+	}
+
+	if(!nr)
+		return ERR_PTR(-EINVAL);
+
+	set = ball_set_alloc(nr, len);
+	if(!set)
+		return ERR_PTR(-ENOMEM);
+
+	text = ball_set_text(set);
+	for(p = buf; p < end; p = nl + 1){
+		size_t n;
+
+		nl = memchr(p, '\n', end - p) ?: end;
+		n = nl - p;
+
+		if(!n)
+			continue;
+
+		memcpy(text, p, n);
+		text[n] = '\n';
+		set->answers[i++] = (struct ball_answer){ .text = text, .len = n + 1 };
+		text += n + 1;
+	}
+
+	return set;
+}
+
+/* /sys/class/8ball/answers: the answers in use, one per line. Writing a new
+ * list replaces them for every device at once, without disturbing open fds.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static ssize_t answers_show(const struct class *cls, const struct class_attribute *attr, char *buf)
+#else
+static ssize_t answers_show(struct class *cls, struct class_attribute *attr, char *buf)
+#endif
+{
+	const struct ball_answer_set *set;
+	int len = 0;
+
+	rcu_read_lock();
+
+	set = rcu_dereference(ball_set);
+	for(unsigned int i = 0; i < set->nr; i++)
+		len += sysfs_emit_at(buf, len, "%.*s", (int)set->answers[i].len, set->answers[i].text);
+
+	rcu_read_unlock();
+
+	return len;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static ssize_t answers_store(const struct class *cls, const struct class_attribute *attr,
+			     const char *buf, size_t count)
+#else
+static ssize_t answers_store(struct class *cls, struct class_attribute *attr,
+			     const char *buf, size_t count)
+#endif
+{
+	struct ball_answer_set *set = ball_set_parse(buf, count);
+	int err;
+
+	if(IS_ERR(set))
+		return PTR_ERR(set);
+
+	err = ball_set_replace(set);
+	if(err)
+		return err;
+
+	ball_genl_notify();
+	return count;
+}
+static CLASS_ATTR_RW(answers);
+
+/* Prints one histogram, followed by the percentiles it implies. A percentile
+ * is reported as the upper bound of the bucket it falls in.
+ */
+static int ball_hist_show(struct seq_file *m, void *v)
+{
+	static const struct {
+		const char *name;
+		unsigned int permille;
+	} pcts[] = {
+		{ "p50", 500 },
+		{ "p99", 990 },
+		{ "p999", 999 },
+	};
+	enum ball_hist hist = (uintptr_t)m->private;
+	unsigned long counts[BALL_HIST_BUCKETS] = {};
+	u64 total = 0;
+	unsigned int b;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		for(b = 0; b < BALL_HIST_BUCKETS; b++)
+			counts[b] += per_cpu(ball_hists, cpu).buckets[hist][b];
+
+	for(b = 0; b < BALL_HIST_BUCKETS; b++){
+		total += counts[b];
+		if(counts[b])
+			seq_printf(m, "%12llu - %-12llu: %lu\n",
+				   b ? 1ULL << (b - 1) : 0, 1ULL << b, counts[b]);
+	}
+
+	seq_printf(m, "total: %llu\n", total);
+
+	if(!total)
+		return 0;
+
+	for(unsigned int p = 0; p < ARRAY_SIZE(pcts); p++){
+		u64 seen = 0;
+
+		for(b = 0; b < BALL_HIST_BUCKETS; b++){
+			seen += counts[b];
+			if(seen * 1000 >= total * pcts[p].permille)
+				break;
+		}
+
+		seq_printf(m, "%s: <= %llu\n", pcts[p].name, 1ULL << b);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ball_hist);
+
+/* Writing anything to /sys/kernel/debug/8ball/reset clears every histogram */
+static ssize_t ball_hist_reset(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&ball_hists, cpu), 0, sizeof(struct ball_hists));
+
+	return count;
+}
+
+static const struct file_operations ball_hist_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = ball_hist_reset,
+	.llseek = noop_llseek,
+};
+
+static void ball_debugfs_init(void)
+{
+	/* debugfs failures aren't worth failing the module load over */
+	ball_drv.debugfs = debugfs_create_dir(DEV_NAME, NULL);
+
+	for(uintptr_t hist = 0; hist < BALL_NR_HISTS; hist++)
+		debugfs_create_file(ball_hist_names[hist], 0444, ball_drv.debugfs,
+				    (void *)hist, &ball_hist_fops);
+
+	debugfs_create_file("reset", 0200, ball_drv.debugfs, NULL, &ball_hist_reset_fops);
+}
+
+/* Generic netlink family "8ball", for daemons that would rather not hold a
+ * device open. Questions are answered by the same code as on the devices and
+ * counted against the device given in EIGHTBALL_A_MINOR (0 by default).
+ */
+static const struct nla_policy ball_genl_policy[EIGHTBALL_A_MAX + 1] = {
+	[EIGHTBALL_A_MINOR] = { .type = NLA_U32 },
+	[EIGHTBALL_A_QUESTION] = { .type = NLA_BINARY },
+	[EIGHTBALL_A_RANDOM] = { .type = NLA_FLAG },
+	[EIGHTBALL_A_WANT_TEXT] = { .type = NLA_FLAG },
+};
+
+static int ball_genl_ask(struct sk_buff *skb, struct genl_info *info);
+static int ball_genl_stats(struct sk_buff *skb, struct genl_info *info);
+
+static const struct genl_ops ball_genl_ops[] = {
+	{
+		.cmd = EIGHTBALL_CMD_ASK,
+		.doit = ball_genl_ask,
+	},
+	{
+		.cmd = EIGHTBALL_CMD_STATS,
+		.doit = ball_genl_stats,
+	},
+};
+
+static const struct genl_multicast_group ball_genl_mcgrps[] = {
+	{ .name = EIGHTBALL_GENL_MCGRP_ANSWERS },
+};
+
+static struct genl_family ball_genl = {
+	.name = EIGHTBALL_GENL_NAME,
+	.version = EIGHTBALL_GENL_VERSION,
+	.maxattr = EIGHTBALL_A_MAX,
+	.policy = ball_genl_policy,
+	.module = THIS_MODULE,
+	.ops = ball_genl_ops,
+	.n_ops = ARRAY_SIZE(ball_genl_ops),
+	.mcgrps = ball_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(ball_genl_mcgrps),
+	.netnsok = true, /* Tenants in containers tend to have a netns of their own */
+};
+
+/* Device a request is about, the first one if it doesn't say. The caller has
+ * to drop the reference it comes with.
+ */
+/* A request is checked against whoever opened the socket as well as whoever
+ * sent it, as the socket may have been handed to someone else
+ */
+static bool ball_genl_allowed(struct ball_dev *bd, struct sk_buff *skb)
+{
+	return ball_dev_allowed(bd) &&
+	       (!bd->owner || in_userns(bd->owner, sk_user_ns(NETLINK_CB(skb).sk)));
+}
+
+static struct ball_dev *ball_genl_dev(struct sk_buff *skb, struct genl_info *info)
+{
+	struct ball_dev *bd;
+	u32 minor = 0;
+
+	if(info->attrs[EIGHTBALL_A_MINOR])
+		minor = nla_get_u32(info->attrs[EIGHTBALL_A_MINOR]);
+
+	bd = ball_dev_get(minor);
+	if(!bd){
+		GENL_SET_ERR_MSG(info, "no such 8ball device");
+		return ERR_PTR(-ENODEV);
+	}
+
+	if(!ball_genl_allowed(bd, skb)){
+		ball_dev_put(bd);
+		GENL_SET_ERR_MSG(info, "8ball device belongs to another user namespace");
+		return ERR_PTR(-EPERM);
+	}
+
+	return bd;
+}
+
+/* Answer every EIGHTBALL_A_QUESTION in the request, in order. The reply holds
+ * the table generation the answers came from, then one EIGHTBALL_A_CHOICE per
+ * question, each followed by its EIGHTBALL_A_ANSWER if text was asked for.
+ */
+static int ball_genl_ask(struct sk_buff *skb, struct genl_info *info)
+{
+	bool random = info->attrs[EIGHTBALL_A_RANDOM];
+	bool want_text = info->attrs[EIGHTBALL_A_WANT_TEXT];
+	struct ball_dev *bd = ball_genl_dev(skb, info);
+	const struct ball_answer_set *set;
+	unsigned int count = 0;
+	struct sk_buff *msg;
+	struct nlattr *attr;
+	int rem, err;
+	size_t size;
+	void *hdr;
+
+	if(IS_ERR(bd))
+		return PTR_ERR(bd);
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem)
+		if(nla_type(attr) == EIGHTBALL_A_QUESTION)
+			count++;
+
+	/* Bounds the size of the reply that has to be allocated up front */
+	if(count > EIGHTBALL_GENL_MAX_QUESTIONS){
+		GENL_SET_ERR_MSG(info, "too many questions in one request");
+		err = -E2BIG;
+		goto out;
+	}
+
+	/* The whole request gets answered or none of it */
+	if(ball_throttle(bd, count)){
+		err = -EBUSY;
+		goto out;
+	}
+
+	size = nla_total_size(sizeof(u32)) +
+	       count * (nla_total_size(sizeof(u32)) + (want_text ? nla_total_size(BALL_ANSWER_MAX) : 0));
+
+	msg = genlmsg_new(size, GFP_KERNEL);
+	if(!msg){
+		err = -ENOMEM;
+		goto out;
+	}
+
+	hdr = genlmsg_put_reply(msg, info, &ball_genl, 0, EIGHTBALL_CMD_ASK);
+	if(!hdr)
+		goto nospace;
+
+	/* One set answers the whole request, and the generation sent along is
+	 * that set's, even if it gets replaced halfway through
+	 */
+	rcu_read_lock();
+	set = rcu_dereference(ball_set);
+
+	if(nla_put_u32(msg, EIGHTBALL_A_GENERATION, set->generation))
+		goto nospace_unlock;
+
+	nlmsg_for_each_attr(attr, info->nlhdr, GENL_HDRLEN, rem){
+		const struct ball_answer *answer;
+		unsigned int choice;
+
+		if(nla_type(attr) != EIGHTBALL_A_QUESTION)
+			continue;
+
+		choice = ball_choose_nr(bd, ball_sum(nla_data(attr), nla_len(attr)), set->nr, random);
+		if(nla_put_u32(msg, EIGHTBALL_A_CHOICE, choice))
+			goto nospace_unlock;
+
+		answer = &set->answers[choice];
+		if(want_text && nla_put(msg, EIGHTBALL_A_ANSWER, answer->len, answer->text))
+			goto nospace_unlock;
+
+		ball_stat_inc(bd, questions);
+		ball_stat_add(bd, bytes_in, nla_len(attr));
+		ball_stat_answer(bd, choice);
+	}
+
+	rcu_read_unlock();
+
+	genlmsg_end(msg, hdr);
+	err = genlmsg_reply(msg, info);
+	goto out;
+
+nospace_unlock:
+	rcu_read_unlock();
+nospace:
+	nlmsg_free(msg);
+	err = -EMSGSIZE;
+out:
+	ball_dev_put(bd);
+	return err;
+}
+
+/* Usage counters of one device, or of all of them added up without a minor */
+static int ball_genl_stats(struct sk_buff *skb, struct genl_info *info)
+{
+	static const struct {
+		int attr;
+		size_t offset;
+	} fields[] = {
+		{ EIGHTBALL_A_STATS_QUESTIONS, offsetof(struct ball_stats, questions) },
+		{ EIGHTBALL_A_STATS_ANSWERS, offsetof(struct ball_stats, answers) },
+		{ EIGHTBALL_A_STATS_BYTES_IN, offsetof(struct ball_stats, bytes_in) },
+		{ EIGHTBALL_A_STATS_BYTES_OUT, offsetof(struct ball_stats, bytes_out) },
+		{ EIGHTBALL_A_STATS_BUSY, offsetof(struct ball_stats, busy) },
+		{ EIGHTBALL_A_STATS_FAULTS, offsetof(struct ball_stats, faults) },
+		{ EIGHTBALL_A_STATS_THROTTLED, offsetof(struct ball_stats, throttled) },
+	};
+	struct ball_dev *one = NULL;
+	struct sk_buff *msg;
+	int err = -EMSGSIZE;
+	void *hdr;
+
+	if(info->attrs[EIGHTBALL_A_MINOR]){
+		one = ball_genl_dev(skb, info);
+		if(IS_ERR(one))
+			return PTR_ERR(one);
+	}
+
+	msg = genlmsg_new(ARRAY_SIZE(fields) * nla_total_size_64bit(sizeof(u64)), GFP_KERNEL);
+	if(!msg){
+		err = -ENOMEM;
+		goto out;
+	}
+
+	hdr = genlmsg_put_reply(msg, info, &ball_genl, 0, EIGHTBALL_CMD_STATS);
+	if(!hdr)
+		goto nospace;
+
+	for(unsigned int f = 0; f < ARRAY_SIZE(fields); f++){
+		u64 sum = 0;
+
+		if(one){
+			sum = ball_stat_sum(one, fields[f].offset);
+		} else {
+			/* Devices that come and go meanwhile may or may not count.
+			 * Other tenants' devices never do, their traffic is theirs.
+			 */
+			rcu_read_lock();
+			for(unsigned int i = 0; i < BALL_MAX_DEVS; i++){
+				struct ball_dev *bd = rcu_dereference(ball_drv.devs[i]);
+
+				if(bd && ball_genl_allowed(bd, skb))
+					sum += ball_stat_sum(bd, fields[f].offset);
+			}
+			rcu_read_unlock();
+		}
+
+		if(nla_put_u64_64bit(msg, fields[f].attr, sum, EIGHTBALL_A_PAD))
+			goto nospace;
+	}
+
+	genlmsg_end(msg, hdr);
+	err = genlmsg_reply(msg, info);
+	goto out;
+
+nospace:
+	nlmsg_free(msg);
+out:
+	if(one)
+		ball_dev_put(one);
+	return err;
+}
+
+/* Tell the "answers" multicast group the answer set was replaced */
+static void ball_genl_notify(void)
+{
+	const struct ball_answer_set *set;
+	struct sk_buff *msg;
+	void *hdr;
+	int err;
+
+	msg = genlmsg_new(2 * nla_total_size(sizeof(u32)), GFP_KERNEL);
+	if(!msg)
+		return;
+
+	hdr = genlmsg_put(msg, 0, 0, &ball_genl, 0, EIGHTBALL_CMD_ANSWERS_CHANGED);
+	if(!hdr)
+		goto free;
+
+	/* Both from the same set, whichever is the newest by now */
+	rcu_read_lock();
+	set = rcu_dereference(ball_set);
+	err = nla_put_u32(msg, EIGHTBALL_A_GENERATION, set->generation) ?:
+	      nla_put_u32(msg, EIGHTBALL_A_NR_CHOICES, set->nr);
+	rcu_read_unlock();
+
+	if(err)
+		goto free;
+
+	genlmsg_end(msg, hdr);
+
+	/* The answers are the same in every netns, so are the listeners told.
+	 * Nobody listening is not an error.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	genlmsg_multicast_allns(&ball_genl, msg, 0, 0);
+#else
+	genlmsg_multicast_allns(&ball_genl, msg, 0, 0, GFP_KERNEL);
+#endif
+	return;
+
+free:
+	nlmsg_free(msg);
+}
+
+/* CPU the next device goes to: the next online CPU, or with per_node=1 the
+ * first CPU of the next node that has any
+ */
+static unsigned int ball_next_cpu(unsigned int cpu)
+{
+	int node;
+
+	if(!per_node){
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		return cpu < nr_cpu_ids ? cpu : cpumask_first(cpu_online_mask);
+	}
+
+	node = next_node(cpu_to_node(cpu), node_states[N_CPU]);
+	if(node >= MAX_NUMNODES)
+		node = first_node(node_states[N_CPU]);
+
+	return cpumask_first_and(cpumask_of_node(node), cpu_online_mask);
+}
+
+/* Allocate the state of a device meant for cpu. It lives on the node of that
+ * CPU, close to the workers that use it.
+ */
+static struct ball_dev *ball_dev_alloc(unsigned int minor, unsigned int cpu)
+{
+	int node = cpu_to_node(cpu);
+	struct ball_dev *bd = kzalloc_node(sizeof(*bd), GFP_KERNEL, node);
+
+	if(!bd)
+		return NULL;
+
+	/* Already allocated on each CPU's own node */
+	bd->stats = alloc_percpu(struct ball_stats);
+	if(!bd->stats){
+		kfree(bd);
+		return NULL;
+	}
+
+	bd->minor = minor;
+	bd->cpu = cpu;
+	bd->node = node;
+	refcount_set(&bd->ref, 1); /* Dropped when the device is removed */
+	atomic_set(&bd->open, CDEV_NOT_USED);
+	init_waitqueue_head(&bd->open_wq);
+
+	return bd;
+}
+
+/* Create the device file for bd and make it reachable by its minor. On
+ * failure the caller still owns bd. Called with ball_devs_lock held.
+ */
+static int ball_dev_add(struct ball_dev *bd)
+{
+	if(rcu_access_pointer(ball_drv.devs[bd->minor]))
+		return -EEXIST;
+
+	bd->device = device_create_with_groups(ball_drv.cls, NULL, MKDEV(ball_drv.major, bd->minor), bd,
+					       ball_groups, DEV_NAME "%u", bd->minor);
+	if(IS_ERR(bd->device))
+		return PTR_ERR(bd->device);
+
+	rcu_assign_pointer(ball_drv.devs[bd->minor], bd);
+	return 0;
+}
+
+/* Remove a device. Fds still open on it keep working until they are closed.
+ * sync can only be skipped when nobody can be looking devices up anymore.
+ * Called with ball_devs_lock held.
+ */
+static int ball_dev_remove(unsigned int minor, bool sync)
+{
+	struct ball_dev *bd;
+
+	bd = rcu_dereference_protected(ball_drv.devs[minor], lockdep_is_held(&ball_devs_lock));
+	if(!bd)
+		return -ENODEV;
+
+	RCU_INIT_POINTER(ball_drv.devs[minor], NULL);
+
+	/* Past this, lookups either got their reference or didn't find it */
+	if(sync)
+		synchronize_rcu();
+
+	device_destroy(ball_drv.cls, MKDEV(ball_drv.major, minor));
+	ball_dev_put(bd);
+
+	return 0;
+}
+
+/* Create the devices there are at load time, spread over the online CPUs (or
+ * nodes)
+ */
+static int ball_add_devs(void)
+{
+	unsigned int i, cpu;
+	int err = 0;
+
+	cpu = cpumask_first(cpu_online_mask);
+	if(per_node) /* Start from the first CPU of its node */
+		cpu = cpumask_first_and(cpumask_of_node(cpu_to_node(cpu)), cpu_online_mask);
+
+	mutex_lock(&ball_devs_lock);
+
+	for(i = 0; i < nr_devs; i++){
+		struct ball_dev *bd = ball_dev_alloc(i, cpu);
+
+		if(!bd){
+			err = -ENOMEM;
+			break;
+		}
+
+		err = ball_dev_add(bd);
+		if(err){
+			ball_dev_put(bd);
+			break;
+		}
+
+		cpu = ball_next_cpu(cpu);
+	}
+
+	mutex_unlock(&ball_devs_lock);
+
+	return err; /* Caller removes whatever got created */
+}
+
+/* Remove every device, once the char device is gone and nothing can look
+ * them up anymore
+ */
+static void ball_remove_devs(void)
+{
+	mutex_lock(&ball_devs_lock);
+
+	for(unsigned int i = 0; i < BALL_MAX_DEVS; i++)
+		ball_dev_remove(i, false);
+
+	mutex_unlock(&ball_devs_lock);
+}
+
+/* User namespace of the task with the given pid (in our pid namespace) */
+static struct user_namespace *ball_pid_user_ns(pid_t pid)
+{
+	struct user_namespace *ns = ERR_PTR(-ESRCH);
+	struct task_struct *task;
+
+	rcu_read_lock();
+
+	task = find_task_by_vpid(pid);
+	if(task)
+		ns = get_user_ns(__task_cred(task)->user_ns);
+
+	rcu_read_unlock();
+
+	return ns;
+}
+
+/* /sys/class/8ball/add_device: "<minor> [pid]" creates /dev/8ball<minor>. With
+ * a pid, the device belongs to that task's user namespace and can only be
+ * opened from within it (or namespaces nested in it), e.g. by one container.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static ssize_t add_device_store(const struct class *cls, const struct class_attribute *attr,
+				const char *buf, size_t count)
+#else
+static ssize_t add_device_store(struct class *cls, struct class_attribute *attr,
+				const char *buf, size_t count)
+#endif
+{
+	struct user_namespace *owner = NULL;
+	char tmp[32], *arg;
+	struct ball_dev *bd;
+	unsigned int minor;
+	size_t len = count;
+	int pid = 0, err;
+
+	/* Only the newline echo adds is dropped. Anything else after the minor,
+	 * even a lone space, has to be a valid pid: "7 $(pidof tenantd)" with
+	 * no tenantd running must fail, not make a device anyone can open.
+	 */
+	if(len && buf[len - 1] == '\n')
+		len--;
+	if(len >= sizeof(tmp))
+		return -EINVAL;
+	memcpy(tmp, buf, len);
+	tmp[len] = '\0';
+
+	arg = strchr(tmp, ' ');
+	if(arg)
+		*arg++ = '\0';
+
+	if(kstrtouint(tmp, 10, &minor) || minor >= BALL_MAX_DEVS)
+		return -EINVAL;
+	if(arg && (kstrtoint(arg, 10, &pid) || pid <= 0))
+		return -EINVAL;
+
+	if(pid){
+		owner = ball_pid_user_ns(pid);
+		if(IS_ERR(owner))
+			return PTR_ERR(owner);
+	}
+
+	bd = ball_dev_alloc(minor, cpumask_local_spread(minor, NUMA_NO_NODE));
+	if(!bd){
+		if(owner)
+			put_user_ns(owner);
+		return -ENOMEM;
+	}
+	bd->owner = owner; /* Let go of with bd */
+
+	mutex_lock(&ball_devs_lock);
+	err = ball_dev_add(bd);
+	mutex_unlock(&ball_devs_lock);
+
+	if(err){
+		ball_dev_put(bd);
+		return err;
+	}
+
+	return count;
+}
+static CLASS_ATTR_WO(add_device);
+
+/* /sys/class/8ball/remove_device: "<minor>" removes /dev/8ball<minor> */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+static ssize_t remove_device_store(const struct class *cls, const struct class_attribute *attr,
+				   const char *buf, size_t count)
+#else
+static ssize_t remove_device_store(struct class *cls, struct class_attribute *attr,
+				   const char *buf, size_t count)
+#endif
+{
+	unsigned int minor;
+	int err;
+
+	err = kstrtouint(buf, 0, &minor);
+	if(err)
+		return err;
+
+	if(minor >= BALL_MAX_DEVS)
+		return -ENODEV;
+
+	mutex_lock(&ball_devs_lock);
+	err = ball_dev_remove(minor, true);
+	mutex_unlock(&ball_devs_lock);
+
+	return err ? err : count;
+}
+static CLASS_ATTR_WO(remove_device);
+
+static const struct class_attribute *ball_class_attrs[] = {
+	&class_attr_answers,
+	&class_attr_add_device,
+	&class_attr_remove_device,
+};
+
+/* Remove the first n files under /sys/class/8ball/ */
+static void ball_class_files_remove(unsigned int n)
+{
+	while(n--)
+		class_remove_file(ball_drv.cls, ball_class_attrs[n]);
+}
+
+static int ball_class_files_create(void)
+{
+	for(unsigned int i = 0; i < ARRAY_SIZE(ball_class_attrs); i++){
+		int err = class_create_file(ball_drv.cls, ball_class_attrs[i]);
+
+		if(err){
+			ball_class_files_remove(i);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int __init ball_init(void)
+{
+	int err;
+
+	if(!nr_devs)
+		nr_devs = min_t(unsigned int, per_node ? num_node_state(N_CPU) : num_online_cpus(),
+				BALL_MAX_DEVS);
+
+	if(nr_devs > BALL_MAX_DEVS){
+		pr_alert("Can't create more than %d devices\n", BALL_MAX_DEVS);
+		return -EINVAL;
+	}
+
+	/* Room for every minor, as devices can be added later on */
+	ball_drv.devs = kcalloc(BALL_MAX_DEVS, sizeof(*ball_drv.devs), GFP_KERNEL);
+	if(!ball_drv.devs)
+		return -ENOMEM;
+
+	err = ball_answers_init();
+	if(err)
+		goto out_free;
+
+	/* Clients open and close at high rates, so per-open state gets a cache of
+	 * its own, charged to the opener's memory cgroup
+	 */
+	ball_drv.file_cache = KMEM_CACHE(ball_file, SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT);
+	if(!ball_drv.file_cache){
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+    /* Registers the device driver and adds its ID (major number) to /proc/devices */
+    ball_drv.major = register_chrdev(0, DEV_NAME, &fops);
+
+    if(ball_drv.major < 0){
+        pr_alert("Failure registering device: %d\n", ball_drv.major);
+		err = ball_drv.major;
+		goto out_free;
+    }
+
+    pr_info("Got device number %d!\n", ball_drv.major);
+	
+/* Similar physical devices are grouped up into device classes.
+ * This class will expose the same interface for all these devices (to the userspace).
+ * BUT the underlying implementation can vary depending on the driver used.
+ * Multiple drivers can be used within a class for a varying amount of devices
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	ball_drv.cls = class_create(DEV_NAME);
+#else 
+	ball_drv.cls = class_create(THIS_MODULE, DEV_NAME);
+#endif
+	if(IS_ERR(ball_drv.cls)){
+		err = PTR_ERR(ball_drv.cls);
+		goto out_unregister;
+	}
+	
+	ball_drv.cls->devnode = set_devnode;
+
+	/* MKDEV is a macro that just bitshifts the major/minor values in an int.
+	 * This serves as the ID of this device (and why this macro is used for deletion)
+	*/
+	err = ball_add_devs();
+	if(err)
+		goto out_destroy;
+
+	/* Device files are created under /dev*/
+	pr_info("Created devices /dev/%s0 to /dev/%s%u\n", DEV_NAME, DEV_NAME, nr_devs - 1);
+
+	/* Only now that every device exists can netlink requests name them */
+	err = genl_register_family(&ball_genl);
+	if(err)
+		goto out_destroy;
+
+	/* Replacing the answers notifies netlink, so that has to be up first */
+	err = ball_class_files_create();
+	if(err)
+		goto out_genl;
+
+	ball_debugfs_init();
+
+    return 0;
+
+out_genl:
+	genl_unregister_family(&ball_genl);
+out_destroy:
+	unregister_chrdev(ball_drv.major, DEV_NAME);
+	ball_remove_devs();
+	class_destroy(ball_drv.cls);
+	goto out_free;
+out_unregister:
+	unregister_chrdev(ball_drv.major, DEV_NAME);
+out_free:
+	kmem_cache_destroy(ball_drv.file_cache);
+	ball_answers_free();
+	kfree(ball_drv.devs);
+	return err;
+}
+
+static void __exit ball_exit(void)
+{
+	ball_class_files_remove(ARRAY_SIZE(ball_class_attrs));
+	genl_unregister_family(&ball_genl);
+	debugfs_remove_recursive(ball_drv.debugfs);
+
+	/* Unregister driver */
+    unregister_chrdev(ball_drv.major, DEV_NAME);
+	
+	/* Unregister devices */
+	ball_remove_devs();
+	class_destroy(ball_drv.cls);
+
+	kmem_cache_destroy(ball_drv.file_cache);
+	ball_answers_free();
+	kfree(ball_drv.devs);
+
+    pr_alert("Removing device: %d\n", ball_drv.major);
+}
+
+/* Methods */
+
+/* Take the device for ourselves in exclusive mode */
+static int ball_claim(struct ball_dev *bd, struct file *filp)
+{
+	/* Performs atomic compare-and exchange:
+	 * 1. ptr to atomic variable (to modify)
+	 * 2. value you expect
+	 * 3. value you want to set
+	 * If curr value == expected, set to new. If not, do nothing
+	 * returns value of atomic variable
+	 * If this value is 0, this means we didn't modify (no access). 
+	 * If it is 1, we modified (have access)
+	 */
+	while(atomic_cmpxchg(&bd->open, CDEV_NOT_USED, CDEV_USED)){
+		if(!exclusive_wait || (filp->f_flags & O_NONBLOCK))
+			return -EBUSY; /* Device is currently busy */
+
+		/* Exclusive waiters are queued at the tail and woken one at a time,
+		 * so the device is handed over in roughly FIFO order without a
+		 * thundering herd. Someone else can still grab it in between, in
+		 * which case we just go back to sleep.
+		 */
+		if(wait_event_interruptible_exclusive(bd->open_wq, atomic_read(&bd->open) == CDEV_NOT_USED))
+			return -ERESTARTSYS; /* Interrupted by a signal */
+	}
+
+	return 0;
+}
+
+/* Give the device back and wake up the next waiting opener */
+static void ball_unclaim(struct ball_dev *bd)
+{
+	atomic_set(&bd->open, CDEV_NOT_USED);
+	wake_up_interruptible(&bd->open_wq);
+}
+
+/* Called when process opens device (creates new fd) */
+static int device_open(struct inode *inode, struct file *filp)
+{	
+	unsigned int minor = iminor(inode);
+	struct ball_file *bf;
+	struct ball_dev *bd;
+	int err;
+
+	/* register_chrdev hands us every minor, not just the ones we created */
+	bd = ball_dev_get(minor);
+	if(!bd){
+		err = -ENODEV;
+		goto out;
+	}
+
+	if(!ball_dev_allowed(bd)){
+		err = -EPERM;
+		goto out_put;
+	}
+
+	if(exclusive){
+		err = ball_claim(bd, filp);
+		if(err){
+			if(err == -EBUSY)
+				ball_stat_inc(bd, busy);
+			goto out_put;
+		}
+	}
+
+	/* On the opener's node, which is where it is going to be used from */
+	bf = kmem_cache_alloc_node(ball_drv.file_cache, GFP_KERNEL | __GFP_ZERO, numa_node_id());
+	if(!bf){
+		if(exclusive)
+			ball_unclaim(bd);
+		err = -ENOMEM;
+		goto out_put;
+	}
+
+	bf->dev = bd;
+	mutex_init(&bf->lock);
+	mutex_init(&bf->ring.lock);
+	init_waitqueue_head(&bf->wq);
+	INIT_KFIFO(bf->fifo);
+
+	/* read_iter/write_iter honour IOCB_NOWAIT, so RWF_NOWAIT and io_uring can
+	 * be told to come back later instead of blocking
+	 */
+	filp->f_mode |= FMODE_NOWAIT;
+	bf->mode = READ_ONCE(bd->mode);
+	bf->decide = READ_ONCE(random_answers) ? EIGHTBALL_DECIDE_RANDOM : EIGHTBALL_DECIDE_SUM;
+
+	bf->sum = READ_ONCE(bd->last_sum);
+	bf->decision = ball_decide_file(bf, bf->sum);
+	bf->answer_ready = true; /* Whatever was asked last can be answered right away */
+
+	filp->private_data = bf;
+	
+	/* Increments a counter that represents how many devices are using this
+	 * device (used to prevent a rmmod when module is in use)
+	 */
+	try_module_get(THIS_MODULE);
+	err = 0;
+	goto out; /* The fd keeps the reference to the device */
+
+out_put:
+	ball_dev_put(bd);
+out:
+	trace_eightball_open(minor, err);
+	return err;
+}
+
+/* Called when process closes device file */
+static int device_release(struct inode *inode, struct file *filp)
+{
+	struct ball_file *bf = filp->private_data;
+	struct ball_dev *bd = bf->dev;
+
+	trace_eightball_release(bd->minor, 0);
+
+	/* Hand the question over to whoever opens the device next */
+	if(bf->written)
+		WRITE_ONCE(bd->last_sum, bf->sum);
+
+	/* The mapping holds a reference to the file, so nothing can still be
+	 * using the rings by now
+	 */
+	vfree(bf->ring.mem);
+	kmem_cache_free(ball_drv.file_cache, bf);
+
+	/* Now ready for next caller */
+	if(exclusive)
+		ball_unclaim(bd);
+
+	ball_dev_put(bd);
+	
+	/* Decrement usage count */
+	module_put(THIS_MODULE);
+	
+	return 0;
+}
+
+/* Is this read/write allowed to sleep? RWF_NOWAIT and io_uring ask for that
+ * per call, O_NONBLOCK for the whole fd.
+ */
+static bool ball_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+/* Take the file lock, unless the caller asked not to wait for anything */
+static int ball_lock(struct kiocb *iocb, struct ball_file *bf)
+{
+	if(!(iocb->ki_flags & IOCB_NOWAIT)){
+		mutex_lock(&bf->lock);
+		return 0;
+	}
+
+	return mutex_trylock(&bf->lock) ? 0 : -EAGAIN;
+}
+
+/* How many answers are queued, for callers not holding the file lock. The
+ * counters only move under it, so each is read once; racing with a writer can
+ * be off by one, which the wake-up that writer sends afterwards makes up for.
+ */
+static unsigned int ball_fifo_len(struct ball_file *bf)
+{
+	return READ_ONCE(bf->fifo.kfifo.in) - READ_ONCE(bf->fifo.kfifo.out);
+}
+
+/* Are there answers waiting in the queue? */
+static bool ball_queued(struct ball_file *bf)
+{
+	return READ_ONCE(bf->line_partial) || ball_fifo_len(bf);
+}
+
+/* Wait for room in the answer queue (or for an answer in it). Called with the
+ * file lock held, which is dropped while sleeping and held again on return,
+ * whether waiting worked out or not.
+ */
+static int ball_wait_queue(struct kiocb *iocb, struct ball_file *bf, bool room)
+{
+	while(room ? kfifo_is_full(&bf->fifo) : !ball_queued(bf)){
+		int err = 0;
+
+		mutex_unlock(&bf->lock);
+
+		if(ball_nonblock(iocb))
+			err = -EAGAIN;
+		else if(wait_event_interruptible(bf->wq,
+				room ? ball_fifo_len(bf) < FIFO_LEN : ball_queued(bf)))
+			err = -ERESTARTSYS; /* Interrupted by a signal */
+
+		mutex_lock(&bf->lock);
+
+		if(err)
+			return err;
+	}
+
+	return 0;
+}
+
+/* iter_iov() only appeared in 6.4, before that the iovecs were reached directly */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
+#define iter_iov(iter) ((iter)->iov)
+#endif
+
+/* Vectored single mode write: every segment of a writev is a whole question
+ * of its own, with its answer queued for reading just like in line mode (and
+ * like there, not queued at all on a write-only fd).
+ */
+static ssize_t ball_write_vec(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct ball_file *bf = iocb->ki_filp->private_data;
+	bool queue = iocb->ki_filp->f_mode & FMODE_READ;
+	const struct iovec *iov = iter_iov(from);
+	size_t skip = from->iov_offset, left = iov_iter_count(from);
+	unsigned long i, queued = 0;
+	ssize_t done = 0, err;
+
+	err = ball_lock(iocb, bf);
+	if(err)
+		return err;
+
+	/* The iterator may already be part way into its first segment */
+	for(i = 0; i < from->nr_segs && left; i++, skip = 0){
+		size_t seg = min(iov[i].iov_len - skip, left);
+		unsigned int sum;
+		ssize_t len;
+
+		if(!seg)
+			continue; /* Nothing asked */
+
+		if(queue){
+			/* Hand back what was taken so far rather than wait for room */
+			if(done && kfifo_is_full(&bf->fifo))
+				break;
+
+			err = ball_wait_queue(iocb, bf, true);
+			if(err)
+				break;
+		}
+
+		if(ball_throttle(bf->dev, 1)){
+			err = -EBUSY;
+			break;
+		}
+
+		len = ball_sum_user(iov[i].iov_base + skip, seg, &sum);
+		if(len != seg){ /* Questions only count whole */
+			err = -EFAULT;
+			ball_stat_inc(bf->dev, faults);
+			break;
+		}
+
+		if(queue)
+			kfifo_put(&bf->fifo, (u8)ball_decide_file(bf, sum));
+		done += len;
+		left -= len;
+		queued++;
+	}
+
+	mutex_unlock(&bf->lock);
+
+	/* Keep the iterator in step with what was taken */
+	iov_iter_advance(from, done);
+
+	if(!done)
+		return err;
+
+	ball_stat_add(bf->dev, questions, queued);
+	ball_stat_add(bf->dev, bytes_in, done);
+
+	wake_up_interruptible_poll(&bf->wq, EPOLLIN | EPOLLRDNORM);
+
+	return done;
+}
+
+/* Line mode write: every line is a question of its own. The answers of a
+ * write-only fd could never be read, so its lines are taken in without queueing
+ * anything, rather than filling the queue and then blocking for good.
+ */
+static ssize_t ball_write_lines(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct ball_file *bf = iocb->ki_filp->private_data;
+	bool queue = iocb->ki_filp->f_mode & FMODE_READ;
+	unsigned int queued = 0;
+	char chunk[CHUNK_LEN];
+	ssize_t done = 0, err;
+
+	err = ball_lock(iocb, bf);
+	if(err)
+		return err;
+
+	while(iov_iter_count(from)){
+		size_t want = min_t(size_t, iov_iter_count(from), CHUNK_LEN), got, used = 0;
+
+		if(queue){
+			/* Short write rather than wait for room, the rest can be retried */
+			if(done && kfifo_is_full(&bf->fifo))
+				break;
+
+			/* Wait for room in the queue before taking in the next line */
+			err = ball_wait_queue(iocb, bf, true);
+			if(err)
+				break;
+		}
+
+		/* copy_from_iter returns number of bytes that it could read from user */
+		got = copy_from_iter(chunk, want, from);
+
+		while(used < got && !(queue && kfifo_is_full(&bf->fifo))){
+			char *nl = memchr(chunk + used, '\n', got - used);
+			size_t n = nl ? nl - (chunk + used) : got - used;
+
+			/* A line is only taken in once it fits in the QPS limit */
+			if(nl && ball_throttle(bf->dev, 1)){
+				err = -EBUSY;
+				break;
+			}
+
+			bf->line_sum += ball_sum(chunk + used, n);
+			used += n;
+
+			if(!nl)
+				break;
+
+			/* One answer per line */
+			if(queue)
+				kfifo_put(&bf->fifo, (u8)ball_decide_file(bf, bf->line_sum));
+			bf->line_sum = 0;
+			used++; /* The newline itself */
+			queued++;
+		}
+
+		/* Whatever did not fit is left for the next round */
+		iov_iter_revert(from, got - used);
+		done += used;
+
+		if(err == -EBUSY)
+			break;
+
+		if(got < want && used == got){ /* Faulted */
+			err = -EFAULT;
+			ball_stat_inc(bf->dev, faults);
+			break;
+		}
+
+		/* Nothing may ever fill the queue (a write-only fd, one huge line), so
+		 * a long write has to stay killable and not hog the CPU
+		 */
+		if(fatal_signal_pending(current)){
+			err = -EINTR;
+			break;
+		}
+		cond_resched();
+	}
+
+	mutex_unlock(&bf->lock);
+
+	if(!done)
+		return err;
+
+	ball_stat_add(bf->dev, questions, queued);
+	ball_stat_add(bf->dev, bytes_in, done);
+
+	if(queued)
+		wake_up_interruptible_poll(&bf->wq, EPOLLIN | EPOLLRDNORM);
+
+	return done;
+}
+
+/* Take the next queued answer, unless one is already half way out */
+static bool ball_next_answer(struct ball_file *bf)
+{
+	u8 choice;
+
+	if(bf->line_partial)
+		return true;
+
+	if(!kfifo_get(&bf->fifo, &choice))
+		return false;
+
+	bf->line_choice = choice;
+	bf->line_off = 0;
+	WRITE_ONCE(bf->line_partial, true);
+	return true;
+}
+
+/* Hand out up to room bytes of the current queued answer. Returns how many
+ * went out, and sets *fault if the user buffer faulted before that.
+ */
+static size_t ball_put_answer(struct ball_file *bf, struct iov_iter *to, size_t room, bool *fault)
+{
+	char text[BALL_ANSWER_MAX];
+	size_t len = ball_get_answer(bf->line_choice, text), want, copied = 0;
+
+	*fault = false;
+
+	/* The set may have been replaced by one with shorter answers midway */
+	if(bf->line_off < len){
+		want = min(len - bf->line_off, room);
+
+		/* copy_to_iter returns number of bytes that it could write to user */
+		copied = copy_to_iter(text + bf->line_off, want, to);
+		bf->line_off += copied;
+		*fault = copied < want;
+	}
+
+	if(bf->line_off >= len){
+		WRITE_ONCE(bf->line_partial, false);
+		ball_stat_answer(bf->dev, bf->line_choice);
+	}
+
+	return copied;
+}
+
+/* Hand out queued answers, in line mode or after a vectored write. A plain
+ * read takes them as one stream of text, as many as fit. A readv gets one
+ * answer per segment instead, cut short if the segment is. *choice is set to
+ * the last answer anything went out of.
+ */
+static ssize_t ball_read_queue(struct kiocb *iocb, struct iov_iter *to, unsigned int *choice)
+{
+	struct ball_file *bf = iocb->ki_filp->private_data;
+	bool vec = iter_is_iovec(to) && to->nr_segs > 1;
+	const struct iovec *iov = vec ? iter_iov(to) : NULL;
+	unsigned long i, nr_segs = vec ? to->nr_segs : 0;
+	ssize_t done = 0, err;
+	bool fault = false;
+	size_t skip;
+
+	err = ball_lock(iocb, bf);
+	if(err)
+		return err;
+
+again:
+	err = ball_wait_queue(iocb, bf, false);
+	if(err){
+		mutex_unlock(&bf->lock);
+		return err;
+	}
+
+	if(vec){
+		/* The iterator may already be part way into its first segment */
+		skip = to->iov_offset;
+		for(i = 0; i < nr_segs && iov_iter_count(to); i++, skip = 0){
+			size_t len = min(iov[i].iov_len - skip, iov_iter_count(to)), copied = 0;
+
+			if(!len)
+				continue; /* No room for an answer */
+
+			/* Nothing may be left to give of an answer cut short by a set
+			 * swap, the segment then goes to the next one
+			 */
+			while(!copied && !fault && ball_next_answer(bf)){
+				*choice = bf->line_choice;
+				copied = ball_put_answer(bf, to, len, &fault);
+			}
+			done += copied;
+
+			if(fault || !copied)
+				break;
+
+			/* One answer per segment, whatever did not fit is dropped */
+			if(bf->line_partial){
+				WRITE_ONCE(bf->line_partial, false);
+				ball_stat_answer(bf->dev, bf->line_choice);
+			}
+
+			/* Move on to the start of the next segment */
+			iov_iter_advance(to, len - copied);
+		}
+	} else {
+		while(iov_iter_count(to) && ball_next_answer(bf)){
+			*choice = bf->line_choice;
+			done += ball_put_answer(bf, to, iov_iter_count(to), &fault);
+
+			if(fault)
+				break;
+		}
+	}
+
+	/* All that was queued was the rest of an answer a set swap cut short,
+	 * which left nothing to give. Line mode waits for a real one, while the
+	 * answers of a vectored single mode write have simply run out.
+	 */
+	if(!done && !fault){
+		if(READ_ONCE(bf->mode) == EIGHTBALL_MODE_LINES)
+			goto again;
+
+		mutex_unlock(&bf->lock);
+		return 0;
+	}
+
+	mutex_unlock(&bf->lock);
+
+	if(!done){
+		ball_stat_inc(bf->dev, faults);
+		return -EFAULT;
+	}
+
+	ball_stat_add(bf->dev, bytes_out, done);
+
+	/* Room in the queue again */
+	wake_up_interruptible_poll(&bf->wq, EPOLLOUT | EPOLLWRNORM);
+
+	return done;
+}
+
+static ssize_t __device_read(struct kiocb *iocb, struct iov_iter *to, unsigned int *choice){
+	
+	struct ball_file *bf = iocb->ki_filp->private_data;
+	loff_t *offset = &iocb->ki_pos;
+	size_t bytes_read, len, length = iov_iter_count(to);
+	char text[BALL_ANSWER_MAX];
+	unsigned int decision;
+	int err;
+
+	if(!length)
+		return 0;
+
+	/* Line mode, or answers queued up by a vectored write */
+	if(READ_ONCE(bf->mode) == EIGHTBALL_MODE_LINES || ball_queued(bf))
+		return ball_read_queue(iocb, to, choice);
+
+	err = ball_lock(iocb, bf);
+	if(err)
+		return err;
+
+	/* The answer was already read, wait until there is a new question */
+	while(!bf->answer_ready){
+		mutex_unlock(&bf->lock);
+
+		if(ball_nonblock(iocb))
+			return -EAGAIN;
+
+		if(wait_event_interruptible(bf->wq, READ_ONCE(bf->answer_ready)))
+			return -ERESTARTSYS; /* Interrupted by a signal */
+
+		mutex_lock(&bf->lock);
+	}
+
+	/* The decision was already made when the question was written */
+	decision = bf->decision;
+	*choice = decision;
+
+	len = ball_get_answer(decision, text);
+
+	if(*offset >= len){ /* If we are at end of message already */
+		*offset = 0; /* Reset offset */
+		WRITE_ONCE(bf->answer_ready, false); /* Answer consumed */
+		mutex_unlock(&bf->lock);
+		return 0; 
+	}
+
+	mutex_unlock(&bf->lock);
+
+	/* Copy as much of the answer as the user buffers can hold in one go. A
+	 * readv just gets it spread over its segments.
+	 */
+	bytes_read = min(length, len - (size_t)*offset);
+
+	/* copy_to_iter returns number of bytes that it could write to user, a
+	 * short read is reported if anything got through
+	 */
+	bytes_read = copy_to_iter(text + *offset, bytes_read, to);
+	if(!bytes_read){
+		ball_stat_inc(bf->dev, faults);
+		return -EFAULT;
+	}
+
+	*offset += bytes_read;
+
+	ball_stat_add(bf->dev, bytes_out, bytes_read);
+	if(*offset == len)
+		ball_stat_answer(bf->dev, decision);
+
+	return bytes_read;
+}
+
+static ssize_t __device_write(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct ball_file *bf = iocb->ki_filp->private_data;
+	loff_t *offset = &iocb->ki_pos;
+	size_t length = iov_iter_count(from);
+	unsigned int sum;
+	ssize_t len;
+	int err;
+
+	if(!length)
+		return 0;
+
+	if(READ_ONCE(bf->mode) == EIGHTBALL_MODE_LINES)
+		return ball_write_lines(iocb, from);
+
+	/* writev: one question per segment */
+	if(iter_is_iovec(from) && from->nr_segs > 1)
+		return ball_write_vec(iocb, from);
+
+	/* Taken before anything is consumed, so a NOWAIT write that can't get it
+	 * leaves the question and the QPS budget alone for the retry
+	 */
+	err = ball_lock(iocb, bf);
+	if(err)
+		return err;
+
+	/* A new question has to fit in the QPS limit, the rest of one always does */
+	if(!*offset && ball_throttle(bf->dev, 1)){
+		mutex_unlock(&bf->lock);
+		return -EBUSY;
+	}
+
+	/* Read question from user, folding it into a sum as it comes in */
+	len = ball_sum_iter(from, length, &sum);
+	if(len < 0){
+		mutex_unlock(&bf->lock);
+		ball_stat_inc(bf->dev, faults);
+		return len;
+	}
+
+	/* Writing from the start of the file is what begins a new question */
+	if(!*offset){
+		bf->sum = 0;
+		ball_stat_inc(bf->dev, questions);
+	}
+	ball_stat_add(bf->dev, bytes_in, len);
+
+	bf->sum += sum;
+
+	bf->decision = ball_decide_file(bf, bf->sum);
+	bf->written = true;
+	WRITE_ONCE(bf->answer_ready, true);
+
+	mutex_unlock(&bf->lock);
+
+	wake_up_interruptible_poll(&bf->wq, EPOLLIN | EPOLLRDNORM);
+
+	*offset += len;
+
+	return len; 
+	/* The return value represents how many bytes were read. For the userspace
+	 * write() call, it will keep trying until it sends all data. Questions can
+	 * be any length, so everything given is always taken.
+	 */
+}
+
+/* Called when a process, which already opened dev file, tries to read */
+static ssize_t device_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct ball_file *bf = iocb->ki_filp->private_data;
+	size_t length = iov_iter_count(to);
+	unsigned int choice = READ_ONCE(bf->decision);
+	u64 start = ktime_get_ns(), now, asked;
+	/* Line mode hands out queued answers, the one that went out gets traced */
+	ssize_t ret = __device_read(iocb, to, &choice);
+
+	now = ktime_get_ns();
+	ball_hist_record(BALL_HIST_READ, now - start);
+
+	/* First bytes of the answer went out, the question has been answered */
+	asked = READ_ONCE(bf->asked_ns);
+	if(ret > 0 && asked){
+		WRITE_ONCE(bf->asked_ns, 0);
+		ball_hist_record(BALL_HIST_ANSWER, now - asked);
+	}
+
+	trace_eightball_read(bf->dev->minor, length, ret, iocb->ki_pos, choice);
+	return ret;
+}
+
+/* Called when a process tries to write to file */
+static ssize_t device_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct ball_file *bf = iocb->ki_filp->private_data;
+	size_t length = iov_iter_count(from);
+	u64 start = ktime_get_ns(), now;
+	ssize_t ret = __device_write(iocb, from);
+
+	now = ktime_get_ns();
+	ball_hist_record(BALL_HIST_WRITE, now - start);
+
+	/* Time to the answer counts from the last chunk of the question */
+	if(ret > 0)
+		WRITE_ONCE(bf->asked_ns, now);
+
+	trace_eightball_write(bf->dev->minor, length, ret, iocb->ki_pos, READ_ONCE(bf->decision));
+	return ret;
+}
+
+/* Answer one question of a batch. The question is read straight from
+ * userspace and the fd's own question is left untouched.
+ */
+static int ball_answer_query(struct ball_file *bf, struct eightball_query *query)
+{
+	struct ball_dev *bd = bf->dev;
+	size_t len = query->question_len;
+	char text[BALL_ANSWER_MAX];
+	unsigned int sum;
+
+	if(ball_throttle(bd, 1))
+		return -EBUSY;
+
+	if(ball_sum_user(u64_to_user_ptr(query->question), len, &sum) != len)
+		return -EFAULT; /* Only a whole question gets an answer */
+
+	query->choice = ball_decide_file(bf, sum);
+
+	if(query->answer){
+		query->answer_len = min_t(size_t, query->answer_len, ball_get_answer(query->choice, text));
+
+		if(copy_to_user(u64_to_user_ptr(query->answer), text, query->answer_len))
+			return -EFAULT;
+	}
+
+	ball_stat_inc(bd, questions);
+	ball_stat_add(bd, bytes_in, len);
+	ball_stat_answer(bd, query->choice);
+
+	return 0;
+}
+
+/* Answer a whole array of questions in one kernel entry */
+static long ball_ask_batch(struct ball_file *bf, struct eightball_batch __user *ubatch)
+{
+	struct ball_dev *bd = bf->dev;
+	struct eightball_query __user *uqueries;
+	struct eightball_batch batch;
+	struct eightball_query query;
+	int err = 0;
+	u32 i;
+
+	if(copy_from_user(&batch, ubatch, sizeof(batch))){
+		ball_stat_inc(bd, faults);
+		return -EFAULT;
+	}
+
+	if(batch.flags)
+		return -EINVAL;
+
+	uqueries = u64_to_user_ptr(batch.queries);
+
+	for(i = 0; i < batch.count; i++){
+		if(copy_from_user(&query, &uqueries[i], sizeof(query))){
+			err = -EFAULT;
+			break;
+		}
+
+		err = ball_answer_query(bf, &query);
+		if(err)
+			break;
+
+		if(copy_to_user(&uqueries[i], &query, sizeof(query))){
+			err = -EFAULT;
+			break;
+		}
+
+		/* Batches can be huge, don't hog the CPU or ignore a kill */
+		if(fatal_signal_pending(current)){
+			err = -EINTR;
+			i++;
+			break;
+		}
+		cond_resched();
+	}
+
+	if(err == -EFAULT)
+		ball_stat_inc(bd, faults);
+
+	/* Like a short read, report what got answered before things went wrong */
+	if(i)
+		return i;
+
+	return err;
+}
+
+/* Allocate the rings for this fd, to be mmap'd by userspace afterwards */
+static long ball_ring_setup(struct ball_file *bf, struct eightball_ring_params __user *uparams)
+{
+	struct eightball_ring_params params;
+	struct ball_ring *ring = &bf->ring;
+	size_t sqes_off, cqes_off, size;
+	u32 entries;
+	void *mem;
+
+	if(copy_from_user(&params, uparams, sizeof(params)))
+		return -EFAULT;
+
+	if(params.flags || !params.entries || params.entries > EIGHTBALL_RING_MAX_ENTRIES)
+		return -EINVAL;
+
+	entries = roundup_pow_of_two(params.entries);
+
+	/* Keep the header indices and the entry arrays on separate cache lines */
+	sqes_off = ALIGN(sizeof(struct eightball_ring), SMP_CACHE_BYTES);
+	cqes_off = sqes_off + entries * sizeof(struct eightball_sqe);
+	size = PAGE_ALIGN(cqes_off + entries * sizeof(struct eightball_cqe));
+
+	/* Zeroed, and safe to hand out to userspace as is */
+	mem = vmalloc_user(size);
+	if(!mem)
+		return -ENOMEM;
+
+	mutex_lock(&ring->lock);
+
+	if(ring->mem){ /* Only one set of rings per fd, it may already be mapped */
+		mutex_unlock(&ring->lock);
+		vfree(mem);
+		return -EBUSY;
+	}
+
+	ring->mem = mem;
+	ring->size = size;
+	ring->hdr = mem;
+	ring->sqes = mem + sqes_off;
+	ring->cqes = mem + cqes_off;
+	ring->entries = entries;
+	ring->sq_head = 0;
+	ring->cq_tail = 0;
+
+	ring->hdr->entries = entries;
+	ring->hdr->mask = entries - 1;
+	ring->hdr->sqes_off = sqes_off;
+	ring->hdr->cqes_off = cqes_off;
+
+	mutex_unlock(&ring->lock);
+
+	params.entries = entries;
+	params.mmap_size = size;
+
+	if(copy_to_user(uparams, &params, sizeof(params)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/* Answer everything userspace posted to the submission ring, straight out of
+ * the shared memory
+ */
+static long ball_ring_enter(struct ball_file *bf)
+{
+	struct ball_ring *ring = &bf->ring;
+	u32 sq_tail, cq_head, pending, mask;
+	long done = 0;
+
+	mutex_lock(&ring->lock);
+
+	if(!ring->mem){
+		mutex_unlock(&ring->lock);
+		return -EINVAL;
+	}
+
+	mask = ring->entries - 1;
+
+	/* Pairs with userspace's release stores after filling sqes / reaping cqes */
+	sq_tail = smp_load_acquire(&ring->hdr->sq_tail);
+	cq_head = smp_load_acquire(&ring->hdr->cq_head);
+
+	/* Don't trust userspace to keep the indices sane */
+	pending = min(sq_tail - ring->sq_head, ring->entries);
+
+	/* Stop early when the completion ring is full, the rest stays queued */
+	while(pending-- && ring->cq_tail - cq_head < ring->entries){
+		struct eightball_sqe *sqe = &ring->sqes[ring->sq_head & mask];
+		struct eightball_cqe *cqe = &ring->cqes[ring->cq_tail & mask];
+		u32 len = READ_ONCE(sqe->question_len);
+
+		cqe->user_data = READ_ONCE(sqe->user_data);
+
+		if(len > EIGHTBALL_RING_QUESTION_LEN){
+			cqe->choice = 0;
+			cqe->res = -EINVAL;
+		} else if(ball_throttle(bf->dev, 1)){
+			cqe->choice = 0;
+			cqe->res = -EBUSY;
+		} else {
+			cqe->choice = ball_decide_file(bf, ball_sum((const char *)sqe->question, len));
+			cqe->res = 0;
+
+			ball_stat_inc(bf->dev, questions);
+			ball_stat_add(bf->dev, bytes_in, len);
+			ball_stat_answer(bf->dev, cqe->choice);
+		}
+
+		ring->sq_head++;
+		ring->cq_tail++;
+		done++;
+	}
+
+	/* Publish the completions before userspace can see the new indices */
+	smp_store_release(&ring->hdr->sq_head, ring->sq_head);
+	smp_store_release(&ring->hdr->cq_tail, ring->cq_tail);
+
+	mutex_unlock(&ring->lock);
+
+	return done;
+}
+
+#ifdef BALL_URING_CMD
+/* Called for IORING_OP_URING_CMD submissions on the fd. The whole question and
+ * answer round trip completes inline, so the answer index goes straight into
+ * the CQE.
+ */
+static int device_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct ball_file *bf = ioucmd->file->private_data;
+	const struct eightball_uring_cmd *cmd;
+	unsigned int choice, sum;
+	u64 question;
+	size_t len;
+
+	if(ioucmd->cmd_op != EIGHTBALL_URING_CMD_ASK)
+		return -ENOTTY;
+
+	/* The payload lives inside the SQE. Unless the command went async, that is
+	 * still the submission ring userspace can write to, so each field is read
+	 * exactly once and only the local copies are used after that.
+	 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	cmd = io_uring_sqe_cmd(ioucmd->sqe);
+#else
+	cmd = ioucmd->cmd;
+#endif
+
+	question = READ_ONCE(cmd->question);
+	len = READ_ONCE(cmd->question_len);
+
+	if(ball_throttle(bf->dev, 1))
+		return -EBUSY;
+
+	if(ball_sum_user(u64_to_user_ptr(question), len, &sum) != len){
+		ball_stat_inc(bf->dev, faults);
+		return -EFAULT; /* Only a whole question gets an answer */
+	}
+
+	choice = ball_decide_file(bf, sum);
+
+	ball_stat_inc(bf->dev, questions);
+	ball_stat_add(bf->dev, bytes_in, len);
+	ball_stat_answer(bf->dev, choice);
+
+	return choice;
+}
+#endif
+
+/* Map the answer table. It is shared by every fd, and must never become
+ * writable, not even through a later mprotect().
+ */
+static int ball_mmap_table(struct vm_area_struct *vma)
+{
+	if(vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	/* Checks the requested range fits in the allocation */
+	return remap_vmalloc_range(vma, ball_drv.table, 0);
+}
+
+/* Called when a process maps the fd, which exposes its rings or the answer
+ * table, depending on the offset
+ */
+static int device_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct ball_file *bf = filp->private_data;
+	struct ball_ring *ring = &bf->ring;
+	int err = -EINVAL; /* Rings have to be set up first */
+
+	if(vma->vm_pgoff == EIGHTBALL_OFF_TABLE >> PAGE_SHIFT)
+		return ball_mmap_table(vma);
+
+	mutex_lock(&ring->lock);
+
+	/* Checks the requested range fits in the allocation */
+	if(ring->mem)
+		err = remap_vmalloc_range(vma, ring->mem, vma->vm_pgoff);
+
+	mutex_unlock(&ring->lock);
+
+	return err;
+}
+
+/* Called by poll/select/epoll. A question can always be written, and an answer
+ * can be read as long as it hasn't been read up to EOF already
+ */
+static __poll_t device_poll(struct file *filp, poll_table *wait)
+{
+	struct ball_file *bf = filp->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(filp, &bf->wq, wait);
+
+	/* No file lock: writers hold it for as long as questions take to copy
+	 * in, and poll must never wait on that
+	 */
+	if(READ_ONCE(bf->mode) == EIGHTBALL_MODE_LINES){
+		/* Writable while the queue has room for another answer */
+		if(ball_fifo_len(bf) < FIFO_LEN)
+			mask |= EPOLLOUT | EPOLLWRNORM;
+		if(ball_queued(bf))
+			mask |= EPOLLIN | EPOLLRDNORM;
+	} else {
+		mask |= EPOLLOUT | EPOLLWRNORM;
+		if(READ_ONCE(bf->answer_ready) || ball_queued(bf))
+			mask |= EPOLLIN | EPOLLRDNORM;
+	}
+
+	return mask;
+}
+
+/* Switch the fd between one question at a time and line mode. Anything half
+ * asked or still queued is dropped.
+ */
+static long ball_set_mode(struct ball_file *bf, unsigned long mode)
+{
+	if(mode != EIGHTBALL_MODE_SINGLE && mode != EIGHTBALL_MODE_LINES)
+		return -EINVAL;
+
+	mutex_lock(&bf->lock);
+
+	WRITE_ONCE(bf->mode, mode);
+	kfifo_reset(&bf->fifo);
+	bf->line_sum = 0;
+	bf->line_partial = false;
+
+	mutex_unlock(&bf->lock);
+
+	/* The line queue just got emptied, writers stuck on it can go on */
+	wake_up_interruptible_poll(&bf->wq, EPOLLOUT | EPOLLWRNORM);
+
+	return 0;
+}
+
+/* Called when a process issues an ioctl on the open fd */
+static long device_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct ball_file *bf = filp->private_data;
+
+	switch(cmd){
+		case EIGHTBALL_IOC_ASK_BATCH:
+			return ball_ask_batch(bf, (struct eightball_batch __user *)arg);
+
+		case EIGHTBALL_IOC_RING_SETUP:
+			return ball_ring_setup(bf, (struct eightball_ring_params __user *)arg);
+
+		case EIGHTBALL_IOC_RING_ENTER:
+			return ball_ring_enter(bf);
+
+		case EIGHTBALL_IOC_SET_MODE:
+			return ball_set_mode(bf, arg);
+
+		case EIGHTBALL_IOC_SET_DECIDE:
+			if(arg != EIGHTBALL_DECIDE_SUM && arg != EIGHTBALL_DECIDE_RANDOM)
+				return -EINVAL;
+			WRITE_ONCE(bf->decide, arg);
+			return 0;
+
+		default:
+			return -ENOTTY;
+	}
+}
+
+/* The KUnit suite reaches into the static functions above */
+#if IS_ENABLED(CONFIG_EIGHTBALL_KUNIT_TEST)
+#include "8ball_kunit.c"
+#endif
 
 module_init(ball_init);
 module_exit(ball_exit);
 
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_AUTHOR("Ekaum");
-MODULE_DESCRIPTION("Simple module that creates an 8ball (/dev/8ball). Ask away!");  
+MODULE_DESCRIPTION("Simple module that creates 8balls (/dev/8ballN). Ask away!");  
@@ -0,0 +1,228 @@
+/*
+ *  8ball.h -- Userspace interface of the 8ball char device
+ *
+ *  Shared between the module and its clients, so only uapi types are used.
+*/
+
+#ifndef _8BALL_H
+#define _8BALL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define EIGHTBALL_IOC_MAGIC 0xB8
+
+/* One question in a batch. The question is read from userspace and the
+ * answer index is written back into choice. If answer is set, the answer
+ * text is also copied there (up to answer_len bytes, no NUL terminator) and
+ * answer_len is updated with the number of bytes written.
+ */
+struct eightball_query {
+	__u64 question; /* Pointer to the question bytes */
+	__u64 answer; /* Optional pointer to a buffer for the answer text */
+	__u32 question_len;
+	__u32 answer_len;
+	__u32 choice; /* Index of the chosen answer (out) */
+	__u32 __reserved;
+};
+
+/* Answer count questions in a single syscall. Returns the number of queries
+ * answered, which is only short of count if one of them faulted or ran into
+ * the device's QPS limit.
+ */
+struct eightball_batch {
+	__u64 queries; /* Pointer to an array of struct eightball_query */
+	__u32 count;
+	__u32 flags; /* Must be 0 */
+};
+
+#define EIGHTBALL_IOC_ASK_BATCH _IOWR(EIGHTBALL_IOC_MAGIC, 0x01, struct eightball_batch)
+
+/* Shared memory rings. EIGHTBALL_IOC_RING_SETUP allocates a submission and a
+ * completion ring for the fd, which is then mapped with
+ * mmap(NULL, params.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0).
+ *
+ * The mapping starts with a struct eightball_ring, followed by the array of
+ * submission entries at sqes_off and the array of completion entries at
+ * cqes_off. Userspace fills sqes[sq_tail & mask] and bumps sq_tail, then
+ * calls EIGHTBALL_IOC_RING_ENTER to have every pending question answered.
+ * Answers are reaped from cqes[cq_head & mask] up to cq_tail, bumping cq_head
+ * to hand the slots back. Tails and heads only ever increase and wrap at 2^32;
+ * use acquire/release ordering when reading/publishing them.
+ */
+#define EIGHTBALL_RING_MAX_ENTRIES 4096
+#define EIGHTBALL_RING_QUESTION_LEN 80
+
+struct eightball_ring_params {
+	__u32 entries; /* Ring size (in), rounded up to a power of two (out) */
+	__u32 flags; /* Must be 0 */
+	__u64 mmap_size; /* Length to pass to mmap (out) */
+};
+
+struct eightball_ring {
+	__u32 sq_head; /* Written by the kernel */
+	__u32 sq_tail; /* Written by userspace */
+	__u32 cq_head; /* Written by userspace */
+	__u32 cq_tail; /* Written by the kernel */
+	__u32 entries;
+	__u32 mask;
+	__u32 sqes_off;
+	__u32 cqes_off;
+};
+
+struct eightball_sqe {
+	__u64 user_data; /* Copied to the matching completion */
+	__u32 question_len;
+	__u32 __reserved;
+	__u8 question[EIGHTBALL_RING_QUESTION_LEN];
+};
+
+struct eightball_cqe {
+	__u64 user_data;
+	__u32 choice; /* Index of the chosen answer */
+	__s32 res; /* 0, -EINVAL if the question was too long or -EBUSY if throttled */
+};
+
+#define EIGHTBALL_IOC_RING_SETUP _IOWR(EIGHTBALL_IOC_MAGIC, 0x02, struct eightball_ring_params)
+/* Answers pending submissions, returns how many were consumed */
+#define EIGHTBALL_IOC_RING_ENTER _IO(EIGHTBALL_IOC_MAGIC, 0x03)
+
+/* Read-only answer table, for clients that want to answer questions themselves.
+ * Map it with
+ * mmap(NULL, EIGHTBALL_TABLE_SIZE, PROT_READ, MAP_SHARED, fd, EIGHTBALL_OFF_TABLE).
+ *
+ * The answer to a question is entry (sum % nr_choices), where sum is the
+ * 32 bit wrapping sum of the question bytes taken as unsigned. Entry i's text
+ * is entries[i].len bytes at entries[i].off from the start of the table (no
+ * NUL terminator).
+ *
+ * generation is odd while the table is being rewritten and changes with every
+ * update. Read it (acquire), give up or retry if it is odd, read what is
+ * needed, then read it again (after an acquire fence): if it changed, the
+ * copy may be torn and has to be taken again. Clients caching the table only
+ * need to compare the generation before trusting their copy.
+ *
+ * EIGHTBALL_TABLE_SIZE has room for the largest answer set the module takes,
+ * 64 answers of up to 128 bytes each.
+ */
+#define EIGHTBALL_OFF_TABLE 0x10000000ULL
+#define EIGHTBALL_TABLE_SIZE 12288
+
+struct eightball_table_entry {
+	__u32 off;
+	__u32 len;
+};
+
+struct eightball_table {
+	__u32 generation;
+	__u32 nr_choices;
+	__u32 __reserved[2];
+	struct eightball_table_entry entries[];
+};
+
+/* How read/write behave on the fd, set with EIGHTBALL_IOC_SET_MODE (the mode
+ * is passed as the ioctl argument itself). New opens start in the mode set in
+ * /sys/class/8ball/8ballN/mode.
+ *
+ * EIGHTBALL_MODE_SINGLE: a write from offset 0 starts a question, further
+ * writes add to it and reads return its answer up to EOF. A writev with more
+ * than one segment asks one question per segment instead, queueing their
+ * answers as in line mode; a readv then gets one answer per segment.
+ *
+ * EIGHTBALL_MODE_LINES: every '\n'-terminated line written is a question, and
+ * its answer is queued on the fd. Reads return the queued answers in order and
+ * never hit EOF. Writes block (or fail with EAGAIN) once too many answers are
+ * waiting to be read.
+ */
+#define EIGHTBALL_MODE_SINGLE 0
+#define EIGHTBALL_MODE_LINES 1
+
+#define EIGHTBALL_IOC_SET_MODE _IO(EIGHTBALL_IOC_MAGIC, 0x04)
+
+/* How answers are chosen on the fd, set with EIGHTBALL_IOC_SET_DECIDE (passed
+ * as the ioctl argument itself). New opens start out with EIGHTBALL_DECIDE_SUM,
+ * or EIGHTBALL_DECIDE_RANDOM when the module's random_answers parameter is set.
+ *
+ * EIGHTBALL_DECIDE_SUM: the answer follows from the question, as described for
+ * the answer table above.
+ *
+ * EIGHTBALL_DECIDE_RANDOM: every question gets an answer picked uniformly at
+ * random, whatever it says. The answer table can't be used to predict these.
+ */
+#define EIGHTBALL_DECIDE_SUM 0
+#define EIGHTBALL_DECIDE_RANDOM 1
+
+#define EIGHTBALL_IOC_SET_DECIDE _IO(EIGHTBALL_IOC_MAGIC, 0x05)
+
+/* io_uring passthrough. Submit an IORING_OP_URING_CMD SQE with cmd_op set to
+ * EIGHTBALL_URING_CMD_ASK and a struct eightball_uring_cmd in its cmd area.
+ * The completion's res is the index of the chosen answer, or -errno.
+ */
+#define EIGHTBALL_URING_CMD_ASK 0x01
+
+struct eightball_uring_cmd {
+	__u64 question; /* Pointer to the question bytes */
+	__u32 question_len;
+	__u32 __reserved;
+};
+
+/* Generic netlink family, resolved by name through the nlctrl family. It is
+ * there in every network namespace.
+ *
+ * EIGHTBALL_CMD_ASK takes any number of EIGHTBALL_A_QUESTION attributes and
+ * answers them in order. The reply carries EIGHTBALL_A_GENERATION (of the
+ * answer table the choices index), then one EIGHTBALL_A_CHOICE per question,
+ * each followed by an EIGHTBALL_A_ANSWER with its text if the request had
+ * EIGHTBALL_A_WANT_TEXT. EIGHTBALL_A_RANDOM picks the answers at random.
+ * Requests with more than EIGHTBALL_GENL_MAX_QUESTIONS questions fail with
+ * E2BIG.
+ *
+ * EIGHTBALL_CMD_STATS replies with the EIGHTBALL_A_STATS_* counters (u64) of
+ * the device in EIGHTBALL_A_MINOR, or without one, of all the devices the
+ * caller's user namespace may use added up.
+ *
+ * Both questions and stats are counted against EIGHTBALL_A_MINOR, device 0
+ * by default. An ASK that doesn't fit in the device's QPS limit as a whole
+ * fails with EBUSY. Devices owned by another user namespace fail with EPERM;
+ * both the sender and the opener of the socket have to be in the owner's.
+ * Members of the EIGHTBALL_GENL_MCGRP_ANSWERS multicast group get
+ * an EIGHTBALL_CMD_ANSWERS_CHANGED with the new EIGHTBALL_A_GENERATION and
+ * EIGHTBALL_A_NR_CHOICES whenever the answers are replaced.
+ */
+#define EIGHTBALL_GENL_NAME "8ball"
+#define EIGHTBALL_GENL_VERSION 1
+#define EIGHTBALL_GENL_MCGRP_ANSWERS "answers"
+#define EIGHTBALL_GENL_MAX_QUESTIONS 1024 /* Per EIGHTBALL_CMD_ASK */
+
+enum {
+	EIGHTBALL_CMD_UNSPEC,
+	EIGHTBALL_CMD_ASK,
+	EIGHTBALL_CMD_STATS,
+	EIGHTBALL_CMD_ANSWERS_CHANGED, /* Multicast only */
+	__EIGHTBALL_CMD_MAX,
+};
+#define EIGHTBALL_CMD_MAX (__EIGHTBALL_CMD_MAX - 1)
+
+enum {
+	EIGHTBALL_A_UNSPEC,
+	EIGHTBALL_A_PAD,
+	EIGHTBALL_A_MINOR, /* u32 */
+	EIGHTBALL_A_QUESTION, /* binary, repeated */
+	EIGHTBALL_A_RANDOM, /* flag */
+	EIGHTBALL_A_WANT_TEXT, /* flag */
+	EIGHTBALL_A_GENERATION, /* u32 */
+	EIGHTBALL_A_CHOICE, /* u32, repeated */
+	EIGHTBALL_A_ANSWER, /* binary, repeated */
+	EIGHTBALL_A_NR_CHOICES, /* u32 */
+	EIGHTBALL_A_STATS_QUESTIONS, /* u64 */
+	EIGHTBALL_A_STATS_ANSWERS, /* u64 */
+	EIGHTBALL_A_STATS_BYTES_IN, /* u64 */
+	EIGHTBALL_A_STATS_BYTES_OUT, /* u64 */
+	EIGHTBALL_A_STATS_BUSY, /* u64 */
+	EIGHTBALL_A_STATS_FAULTS, /* u64 */
+	EIGHTBALL_A_STATS_THROTTLED, /* u64 */
+	__EIGHTBALL_A_MAX,
+};
+#define EIGHTBALL_A_MAX (__EIGHTBALL_A_MAX - 1)
+
+#endif /* _8BALL_H */
@@ -0,0 +1,298 @@
+/*
+ *  8ball_kunit.c -- KUnit tests for the 8ball sum/decide core
+ *
+ *  Included at the end of 8ball.c when CONFIG_EIGHTBALL_KUNIT_TEST is set, so
+ *  the tests can reach its static functions. The suite runs when the module
+ *  is loaded; results go to the kernel log and /sys/kernel/debug/kunit/8ball/.
+ *
+ *  Everything here checks that a question keeps mapping to the same answer,
+ *  whatever is done to make the summing faster.
+*/
+
+#include <kunit/test.h>
+#include <linux/sizes.h>
+
+/* kunit_test_suites() only coexists with module_init() since 6.0 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
+#error "The 8ball KUnit tests need a 6.0 or newer kernel"
+#endif
+
+/* Older kernels only have WRITE, which is the same value */
+#ifndef ITER_SOURCE
+#define ITER_SOURCE WRITE
+#endif
+
+/* Long enough to go past a couple of lane folds of ball_sum, with room left
+ * over to start at any alignment
+ */
+#define BALL_TEST_LEN ((2 * BALL_SUM_MAX_WORDS + 3) * sizeof(unsigned long))
+#define BALL_TEST_OFFSETS (2 * sizeof(unsigned long))
+
+/* What the byte sum has always meant: every byte taken as unsigned, one at a time */
+static unsigned int ball_sum_ref(const char *buf, size_t len)
+{
+	unsigned int sum = 0;
+
+	for(size_t i = 0; i < len; i++)
+		sum += (unsigned char)buf[i];
+
+	return sum;
+}
+
+static char *ball_test_buf(struct kunit *test)
+{
+	char *buf = kunit_kmalloc(test, BALL_TEST_LEN + BALL_TEST_OFFSETS, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+	return buf;
+}
+
+/* Every length and starting alignment over buf, against the reference */
+static void ball_sum_check_all(struct kunit *test, const char *buf)
+{
+	for(size_t off = 0; off < BALL_TEST_OFFSETS; off++)
+		for(size_t len = 0; len <= BALL_TEST_LEN; len++)
+			KUNIT_ASSERT_EQ_MSG(test, ball_sum(buf + off, len), ball_sum_ref(buf + off, len),
+					    "off %zu len %zu", off, len);
+}
+
+/* Random bytes, with every odd length and offset */
+static void ball_sum_random_bytes(struct kunit *test)
+{
+	char *buf = ball_test_buf(test);
+
+	get_random_bytes(buf, BALL_TEST_LEN + BALL_TEST_OFFSETS);
+	ball_sum_check_all(test, buf);
+}
+
+/* Bytes with the high bit set are negative chars on signed-char architectures,
+ * and must still add up as 128..255
+ */
+static void ball_sum_high_bit(struct kunit *test)
+{
+	char *buf = ball_test_buf(test);
+
+	for(size_t i = 0; i < BALL_TEST_LEN + BALL_TEST_OFFSETS; i++)
+		buf[i] = (char)(0x80 | (i & 0x7f));
+	ball_sum_check_all(test, buf);
+
+	/* A signed char loop would come out negative on these */
+	KUNIT_EXPECT_EQ(test, ball_sum("\x80", 1), 128U);
+	KUNIT_EXPECT_EQ(test, ball_sum("\xfe\xff", 2), 0xfeU + 0xffU);
+}
+
+/* All 0xff is the worst case for the 16-bit lanes, they fill up fastest */
+static void ball_sum_all_ff(struct kunit *test)
+{
+	size_t len = SZ_1M;
+	char *buf = ball_test_buf(test), *big;
+
+	memset(buf, 0xff, BALL_TEST_LEN + BALL_TEST_OFFSETS);
+	ball_sum_check_all(test, buf);
+
+	/* Thousands of folds in a row */
+	big = kunit_kmalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, big);
+	memset(big, 0xff, len);
+	KUNIT_EXPECT_EQ(test, ball_sum(big, len), (unsigned int)(0xff * len));
+	KUNIT_EXPECT_EQ(test, ball_sum(big + 1, len - 3), (unsigned int)(0xff * (len - 3)));
+}
+
+/* The word-at-a-time sum against the byte loop it replaced, at random lengths
+ * (up to several folds) and random alignments
+ */
+static void ball_sum_random_lengths(struct kunit *test)
+{
+	size_t max = 4 * BALL_TEST_LEN;
+	char *buf = kunit_kmalloc(test, max + BALL_TEST_OFFSETS, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+	for(unsigned int round = 0; round < 4096; round++){
+		size_t off = get_random_u32() % BALL_TEST_OFFSETS;
+		size_t len = get_random_u32() % (max + 1);
+
+		/* New bytes every so often, cheaper than every round */
+		if(!(round % 64))
+			get_random_bytes(buf, max + BALL_TEST_OFFSETS);
+
+		KUNIT_ASSERT_EQ_MSG(test, ball_sum(buf + off, len), ball_sum_ref(buf + off, len),
+				    "off %zu len %zu", off, len);
+	}
+}
+
+/* Every byte value, at every position within a word and every alignment */
+static void ball_sum_every_byte(struct kunit *test)
+{
+	char *buf = ball_test_buf(test);
+
+	for(unsigned int c = 0; c < 256; c++){
+		/* A buffer of nothing but c */
+		memset(buf, c, BALL_TEST_LEN + BALL_TEST_OFFSETS);
+		for(size_t off = 0; off < BALL_TEST_OFFSETS; off++)
+			KUNIT_ASSERT_EQ_MSG(test, ball_sum(buf + off, BALL_TEST_LEN),
+					    (unsigned int)(c * BALL_TEST_LEN), "byte %#x off %zu", c, off);
+
+		/* c alone in each lane of a couple of words of zeroes */
+		memset(buf, 0, 3 * sizeof(unsigned long));
+		for(size_t pos = 0; pos < 3 * sizeof(unsigned long); pos++){
+			buf[pos] = c;
+			for(size_t off = 0; off <= pos; off++)
+				KUNIT_ASSERT_EQ_MSG(test, ball_sum(buf + off, 3 * sizeof(unsigned long) - off),
+						    c, "byte %#x pos %zu off %zu", c, pos, off);
+			buf[pos] = 0;
+		}
+
+		cond_resched();
+	}
+
+	/* And all of them one after the other */
+	for(size_t i = 0; i < BALL_TEST_LEN + BALL_TEST_OFFSETS; i++)
+		buf[i] = (char)i;
+	ball_sum_check_all(test, buf);
+}
+
+/* The answer index is the sum modulo the number of answers, for any set size */
+static void ball_decide_reference(struct kunit *test)
+{
+	static const unsigned int sums[] = { 0, 1, 9, 10, 0x7fffffff, 0x80000000, 0xfffffffe, 0xffffffff };
+
+	for(unsigned int nr = 1; nr <= BALL_MAX_CHOICES; nr++){
+		for(unsigned int i = 0; i < ARRAY_SIZE(sums); i++){
+			KUNIT_EXPECT_EQ(test, ball_decide(sums[i], nr), sums[i] % nr);
+			KUNIT_EXPECT_LT(test, ball_decide(sums[i], nr), nr);
+		}
+
+		for(unsigned int i = 0; i < 64; i++){
+			unsigned int sum = get_random_u32();
+
+			KUNIT_EXPECT_EQ(test, ball_decide(sum, nr), sum % nr);
+		}
+	}
+
+	/* A known question against the built-in answers */
+	KUNIT_EXPECT_EQ(test, ball_decide(ball_sum("Will it rain?", 13), NUM_CHOICES),
+			ball_sum_ref("Will it rain?", 13) % NUM_CHOICES);
+}
+
+/* A write only hands in the bytes it was given. Whatever follows them in the
+ * buffer, say what is left over from a longer earlier question, must not make
+ * it into the sum, and a question written in parts sums the same as written in
+ * one go (the write path adds the parts up in bf->sum).
+ */
+static void ball_sum_partial_writes(struct kunit *test)
+{
+	static const char question[] = "Will it rain?";
+	size_t len = sizeof(question) - 1, split;
+	char *buf = ball_test_buf(test);
+	unsigned int whole, sum;
+	struct iov_iter iter;
+	struct kvec kvec;
+	ssize_t got;
+
+	/* Stale bytes from an earlier question right after this one */
+	memset(buf, '?', BALL_TEST_LEN);
+	memcpy(buf, question, len);
+	whole = ball_sum_ref(question, len);
+
+	kvec = (struct kvec){ .iov_base = buf, .iov_len = BALL_TEST_LEN };
+	iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, BALL_TEST_LEN);
+
+	got = ball_sum_iter(&iter, len, &sum);
+	KUNIT_EXPECT_EQ(test, got, (ssize_t)len);
+	KUNIT_EXPECT_EQ(test, sum, whole);
+	KUNIT_EXPECT_EQ(test, iov_iter_count(&iter), BALL_TEST_LEN - len); /* Stale bytes left alone */
+
+	/* Every way of cutting it in two */
+	for(split = 0; split <= len; split++){
+		unsigned int first, second;
+
+		iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, BALL_TEST_LEN);
+		KUNIT_ASSERT_EQ(test, ball_sum_iter(&iter, split, &first), (ssize_t)split);
+		KUNIT_ASSERT_EQ(test, ball_sum_iter(&iter, len - split, &second), (ssize_t)(len - split));
+
+		KUNIT_EXPECT_EQ_MSG(test, first + second, whole, "split at %zu", split);
+		KUNIT_EXPECT_EQ(test, ball_decide(first + second, NUM_CHOICES),
+				ball_decide(whole, NUM_CHOICES));
+	}
+
+	/* Nothing written, nothing summed */
+	iov_iter_kvec(&iter, ITER_SOURCE, &kvec, 1, BALL_TEST_LEN);
+	KUNIT_EXPECT_EQ(test, ball_sum_iter(&iter, 0, &sum), (ssize_t)0);
+	KUNIT_EXPECT_EQ(test, sum, 0U);
+}
+
+/* Not a check, a measurement: how long summing takes at a few question sizes,
+ * next to the byte-by-byte reference, so changes to ball_sum can be timed.
+ */
+static void ball_sum_bench(struct kunit *test)
+{
+	static const size_t sizes[] = { 16, 80, 256, 4096, SZ_64K };
+	size_t len = SZ_64K + BALL_TEST_OFFSETS;
+	char *buf = kunit_kmalloc(test, len, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+	get_random_bytes(buf, len);
+
+	for(unsigned int i = 0; i < ARRAY_SIZE(sizes); i++){
+		size_t size = sizes[i], iters = SZ_16M / size;
+		unsigned int sum = 0, ref = 0;
+		u64 start, fast, slow;
+
+		start = ktime_get_ns();
+		for(size_t n = 0; n < iters; n++)
+			sum += ball_sum(buf + (n % BALL_TEST_OFFSETS), size);
+		fast = ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		for(size_t n = 0; n < iters; n++)
+			ref += ball_sum_ref(buf + (n % BALL_TEST_OFFSETS), size);
+		slow = ktime_get_ns() - start;
+
+		/* Also keeps the loops from being optimized away */
+		KUNIT_EXPECT_EQ(test, sum, ref);
+
+		kunit_info(test, "%zu bytes: ball_sum %llu ns, reference %llu ns (%zu calls)\n",
+			   size, fast, slow, iters);
+		cond_resched();
+	}
+}
+
+/* Same for picking the answer out of random sums */
+static void ball_decide_bench(struct kunit *test)
+{
+	size_t iters = SZ_1M;
+	unsigned int *sums = kunit_kmalloc_array(test, iters, sizeof(*sums), GFP_KERNEL);
+	unsigned int acc = 0;
+	u64 start, ns;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sums);
+	get_random_bytes(sums, iters * sizeof(*sums));
+
+	start = ktime_get_ns();
+	for(size_t n = 0; n < iters; n++)
+		acc += ball_decide(sums[n], NUM_CHOICES);
+	ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_LT(test, acc, (unsigned int)(iters * NUM_CHOICES));
+	kunit_info(test, "ball_decide %llu ns (%zu calls)\n", ns, iters);
+}
+
+static struct kunit_case ball_test_cases[] = {
+	KUNIT_CASE(ball_sum_random_bytes),
+	KUNIT_CASE(ball_sum_high_bit),
+	KUNIT_CASE(ball_sum_all_ff),
+	KUNIT_CASE(ball_sum_random_lengths),
+	KUNIT_CASE(ball_sum_every_byte),
+	KUNIT_CASE(ball_decide_reference),
+	KUNIT_CASE(ball_sum_partial_writes),
+	KUNIT_CASE(ball_sum_bench),
+	KUNIT_CASE(ball_decide_bench),
+	{}
+};
+
+static struct kunit_suite ball_test_suite = {
+	.name = "8ball",
+	.test_cases = ball_test_cases,
+};
+kunit_test_suite(ball_test_suite);
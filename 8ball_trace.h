@@ -0,0 +1,98 @@
+/*
+ *  8ball_trace.h -- Tracepoints of the 8ball char device
+ *
+ *  Show up under /sys/kernel/tracing/events/eightball/ (trace systems can't
+ *  start with a digit), for use with perf, bpftrace and friends.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM eightball
+
+#if !defined(_8BALL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _8BALL_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/sched.h>
+
+DECLARE_EVENT_CLASS(eightball_file,
+
+	TP_PROTO(unsigned int minor, int ret),
+
+	TP_ARGS(minor, ret),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(unsigned int, minor)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->pid = current->pid;
+		__entry->minor = minor;
+		__entry->ret = ret;
+	),
+
+	TP_printk("pid=%d minor=%u ret=%d", __entry->pid, __entry->minor, __entry->ret)
+);
+
+DEFINE_EVENT(eightball_file, eightball_open,
+	TP_PROTO(unsigned int minor, int ret),
+	TP_ARGS(minor, ret)
+);
+
+DEFINE_EVENT(eightball_file, eightball_release,
+	TP_PROTO(unsigned int minor, int ret),
+	TP_ARGS(minor, ret)
+);
+
+/* ret is the number of bytes transferred or -errno, offset is the file
+ * position after the call. For reads, decision is the answer that went out,
+ * the last one when a read hands out several queued answers.
+ */
+DECLARE_EVENT_CLASS(eightball_io,
+
+	TP_PROTO(unsigned int minor, size_t len, ssize_t ret, loff_t offset, unsigned int decision),
+
+	TP_ARGS(minor, len, ret, offset, decision),
+
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__field(unsigned int, minor)
+		__field(size_t, len)
+		__field(ssize_t, ret)
+		__field(loff_t, offset)
+		__field(unsigned int, decision)
+	),
+
+	TP_fast_assign(
+		__entry->pid = current->pid;
+		__entry->minor = minor;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->offset = offset;
+		__entry->decision = decision;
+	),
+
+	TP_printk("pid=%d minor=%u len=%zu ret=%zd offset=%lld decision=%u",
+		  __entry->pid, __entry->minor, __entry->len, __entry->ret,
+		  __entry->offset, __entry->decision)
+);
+
+DEFINE_EVENT(eightball_io, eightball_read,
+	TP_PROTO(unsigned int minor, size_t len, ssize_t ret, loff_t offset, unsigned int decision),
+	TP_ARGS(minor, len, ret, offset, decision)
+);
+
+DEFINE_EVENT(eightball_io, eightball_write,
+	TP_PROTO(unsigned int minor, size_t len, ssize_t ret, loff_t offset, unsigned int decision),
+	TP_ARGS(minor, len, ret, offset, decision)
+);
+
+#endif /* _8BALL_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE 8ball_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,516 @@
+/*
+ *  8ball-bench.c -- Load generator and benchmark for /dev/8ballN
+ *
+ *  Hammers the device with questions through one of its interfaces for a fixed
+ *  amount of time, then reports throughput, latency percentiles and how many
+ *  syscalls each answer cost.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "8ball.h"
+
+#define HIST_BUCKETS 32 /* log2 buckets of nanoseconds, the same as the module's debugfs ones */
+
+enum mode {
+	MODE_RW, /* echo then cat: reopen, write, reopen, read to EOF */
+	MODE_SHARED, /* every thread on one fd, pwrite + pread */
+	MODE_PERFD, /* one fd per thread, pwrite + pread */
+	MODE_BATCH, /* EIGHTBALL_IOC_ASK_BATCH */
+	MODE_RING, /* mmap'd rings + EIGHTBALL_IOC_RING_ENTER */
+	MODE_TABLE, /* answered locally from the mmap'd answer table */
+};
+
+static const char * const mode_names[] = {
+	[MODE_RW] = "rw",
+	[MODE_SHARED] = "shared",
+	[MODE_PERFD] = "perfd",
+	[MODE_BATCH] = "batch",
+	[MODE_RING] = "ring",
+	[MODE_TABLE] = "table",
+};
+
+struct config {
+	enum mode mode;
+	const char *path;
+	const char *question;
+	size_t question_len;
+	unsigned int threads;
+	unsigned int batch; /* Questions per batch ioctl / ring enter */
+	unsigned int seconds;
+};
+
+/* Per-thread results, merged once everybody is done */
+struct worker {
+	pthread_t thread;
+	const struct config *cfg;
+	int fd;
+	unsigned long answers;
+	unsigned long syscalls;
+	unsigned long hist[HIST_BUCKETS]; /* Latency of one call (one batch for batch/ring) */
+	int err;
+};
+
+static atomic_bool stop;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void hist_record(unsigned long *hist, uint64_t ns)
+{
+	unsigned int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if(bucket >= HIST_BUCKETS)
+		bucket = HIST_BUCKETS - 1;
+	hist[bucket]++;
+}
+
+/* Upper bound of the bucket holding the given percentile */
+static uint64_t hist_percentile(const unsigned long *hist, double pct)
+{
+	unsigned long total = 0, seen = 0;
+	unsigned int b;
+
+	for(b = 0; b < HIST_BUCKETS; b++)
+		total += hist[b];
+
+	if(!total)
+		return 0;
+
+	for(b = 0; b < HIST_BUCKETS; b++){
+		seen += hist[b];
+		if(seen >= total * pct / 100.0)
+			break;
+	}
+
+	return 1ULL << b;
+}
+
+/* echo, then cat: open + write + close, then open + read + read(EOF) + close.
+ * The device has no llseek, so the question is handed over through the close
+ * and the reopen, just like between the two commands.
+ */
+static int run_rw(struct worker *w)
+{
+	const struct config *cfg = w->cfg;
+	char answer[128];
+
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)){
+		uint64_t start = now_ns();
+		ssize_t ret;
+		int fd;
+
+		fd = open(cfg->path, O_WRONLY);
+		if(fd < 0)
+			return -errno;
+		ret = write(fd, cfg->question, cfg->question_len);
+		close(fd);
+		if(ret < 0)
+			return -errno;
+
+		fd = open(cfg->path, O_RDONLY);
+		if(fd < 0)
+			return -errno;
+		errno = 0;
+		if(read(fd, answer, sizeof(answer)) <= 0 || read(fd, answer, sizeof(answer)) < 0){
+			ret = errno ? -errno : -EIO; /* No answer at all counts as failure too */
+			close(fd);
+			return ret;
+		}
+		close(fd);
+
+		hist_record(w->hist, now_ns() - start);
+		w->answers++;
+		w->syscalls += 7;
+	}
+
+	return 0;
+}
+
+/* pwrite + pread at offset 0, so threads sharing an fd don't fight over f_pos */
+static int run_pio(struct worker *w)
+{
+	const struct config *cfg = w->cfg;
+	char answer[128];
+
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)){
+		uint64_t start = now_ns();
+
+		errno = 0;
+		if(pwrite(w->fd, cfg->question, cfg->question_len, 0) < 0 ||
+		   pread(w->fd, answer, sizeof(answer), 0) <= 0)
+			return errno ? -errno : -EIO; /* No answer at all counts as failure too */
+
+		hist_record(w->hist, now_ns() - start);
+		w->answers++;
+		w->syscalls += 2;
+	}
+
+	return 0;
+}
+
+static int run_batch(struct worker *w)
+{
+	const struct config *cfg = w->cfg;
+	struct eightball_query *queries;
+	struct eightball_batch batch;
+	int err = 0;
+
+	queries = calloc(cfg->batch, sizeof(*queries));
+	if(!queries)
+		return -ENOMEM;
+
+	for(unsigned int i = 0; i < cfg->batch; i++){
+		queries[i].question = (uintptr_t)cfg->question;
+		queries[i].question_len = cfg->question_len;
+	}
+
+	batch = (struct eightball_batch){
+		.queries = (uintptr_t)queries,
+		.count = cfg->batch,
+	};
+
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)){
+		uint64_t start = now_ns();
+		int ret = ioctl(w->fd, EIGHTBALL_IOC_ASK_BATCH, &batch);
+
+		if(ret < 0){
+			err = -errno;
+			break;
+		}
+
+		hist_record(w->hist, now_ns() - start);
+		w->answers += ret;
+		w->syscalls++;
+	}
+
+	free(queries);
+	return err;
+}
+
+static int run_ring(struct worker *w)
+{
+	const struct config *cfg = w->cfg;
+	struct eightball_ring_params params = { .entries = cfg->batch };
+	struct eightball_ring *ring;
+	struct eightball_sqe *sqes;
+	struct eightball_cqe *cqes;
+	size_t len = cfg->question_len;
+	void *mem;
+	int err = 0;
+
+	if(len > EIGHTBALL_RING_QUESTION_LEN)
+		len = EIGHTBALL_RING_QUESTION_LEN;
+
+	if(ioctl(w->fd, EIGHTBALL_IOC_RING_SETUP, &params) < 0)
+		return -errno;
+
+	mem = mmap(NULL, params.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, w->fd, 0);
+	if(mem == MAP_FAILED)
+		return -errno;
+
+	ring = mem;
+	sqes = (void *)((char *)mem + ring->sqes_off);
+	cqes = (void *)((char *)mem + ring->cqes_off);
+
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)){
+		uint32_t tail = ring->sq_tail, head, ctail;
+		uint64_t start = now_ns();
+		int ret;
+
+		/* Fill the whole submission ring */
+		for(unsigned int i = 0; i < ring->entries; i++, tail++){
+			struct eightball_sqe *sqe = &sqes[tail & ring->mask];
+
+			sqe->user_data = tail;
+			sqe->question_len = len;
+			memcpy(sqe->question, cfg->question, len);
+		}
+		__atomic_store_n(&ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+		ret = ioctl(w->fd, EIGHTBALL_IOC_RING_ENTER);
+		if(ret < 0){
+			err = -errno;
+			break;
+		}
+
+		/* Reap everything that completed */
+		head = ring->cq_head;
+		ctail = __atomic_load_n(&ring->cq_tail, __ATOMIC_ACQUIRE);
+		while(head != ctail){
+			if(cqes[head & ring->mask].res)
+				err = cqes[head & ring->mask].res;
+			head++;
+		}
+		__atomic_store_n(&ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if(err)
+			break;
+
+		hist_record(w->hist, now_ns() - start);
+		w->answers += ret;
+		w->syscalls++;
+	}
+
+	munmap(mem, params.mmap_size);
+	return err;
+}
+
+/* No syscalls at all: sum the question and look it up in the shared table,
+ * retrying whenever the generation shows the table changed underneath
+ */
+static int run_table(struct worker *w)
+{
+	const struct config *cfg = w->cfg;
+	const struct eightball_table *t;
+	char answer[128];
+	void *mem;
+
+	mem = mmap(NULL, EIGHTBALL_TABLE_SIZE, PROT_READ, MAP_SHARED, w->fd, EIGHTBALL_OFF_TABLE);
+	if(mem == MAP_FAILED)
+		return -errno;
+
+	t = mem;
+
+	while(!atomic_load_explicit(&stop, memory_order_relaxed)){
+		uint64_t start = now_ns();
+		uint32_t gen, sum = 0, choice, len;
+
+		for(size_t i = 0; i < cfg->question_len; i++)
+			sum += (unsigned char)cfg->question[i];
+
+		do {
+			gen = __atomic_load_n(&t->generation, __ATOMIC_ACQUIRE);
+			if(gen & 1)
+				continue; /* Being rewritten */
+
+			choice = sum % t->nr_choices;
+			len = t->entries[choice].len;
+			if(len > sizeof(answer))
+				len = sizeof(answer);
+			memcpy(answer, (const char *)t + t->entries[choice].off, len);
+
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		} while((gen & 1) || __atomic_load_n(&t->generation, __ATOMIC_RELAXED) != gen);
+
+		hist_record(w->hist, now_ns() - start);
+		w->answers++;
+	}
+
+	munmap(mem, EIGHTBALL_TABLE_SIZE);
+	return 0;
+}
+
+static void *worker_fn(void *arg)
+{
+	struct worker *w = arg;
+
+	switch(w->cfg->mode){
+		case MODE_RW:
+			w->err = run_rw(w);
+			break;
+
+		case MODE_SHARED:
+		case MODE_PERFD:
+			w->err = run_pio(w);
+			break;
+
+		case MODE_BATCH:
+			w->err = run_batch(w);
+			break;
+
+		case MODE_RING:
+			w->err = run_ring(w);
+			break;
+
+		case MODE_TABLE:
+			w->err = run_table(w);
+			break;
+	}
+
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m MODE     rw, shared, perfd, batch, ring or table (default: rw)\n"
+		"  -t THREADS  worker threads (default: 1)\n"
+		"  -b N        questions per batch ioctl / ring size (default: 64)\n"
+		"  -d SECONDS  how long to run (default: 5)\n"
+		"  -f PATH     device to use (default: /dev/8ball0)\n"
+		"  -q TEXT     question to ask (default: \"Will this be fast?\")\n",
+		prog);
+}
+
+static int parse_mode(const char *name, enum mode *mode)
+{
+	for(unsigned int i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++){
+		if(!strcmp(name, mode_names[i])){
+			*mode = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct config cfg = {
+		.mode = MODE_RW,
+		.path = "/dev/8ball0",
+		.question = "Will this be fast?",
+		.threads = 1,
+		.batch = 64,
+		.seconds = 5,
+	};
+	unsigned long answers = 0, syscalls = 0, hist[HIST_BUCKETS] = { 0 };
+	struct worker *workers;
+	uint64_t start, elapsed;
+	int shared_fd = -1;
+	int opt, ret = 0;
+
+	while((opt = getopt(argc, argv, "m:t:b:d:f:q:h")) != -1){
+		switch(opt){
+			case 'm':
+				if(parse_mode(optarg, &cfg.mode)){
+					fprintf(stderr, "Unknown mode %s\n", optarg);
+					return 1;
+				}
+				break;
+
+			case 't':
+				cfg.threads = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'b':
+				cfg.batch = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'd':
+				cfg.seconds = strtoul(optarg, NULL, 0);
+				break;
+
+			case 'f':
+				cfg.path = optarg;
+				break;
+
+			case 'q':
+				cfg.question = optarg;
+				break;
+
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	cfg.question_len = strlen(cfg.question);
+
+	if(!cfg.threads || !cfg.batch || !cfg.seconds){
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Every other mode gives each thread an fd of its own */
+	if(cfg.mode == MODE_SHARED){
+		shared_fd = open(cfg.path, O_RDWR);
+		if(shared_fd < 0){
+			perror(cfg.path);
+			return 1;
+		}
+	}
+
+	workers = calloc(cfg.threads, sizeof(*workers));
+	if(!workers){
+		perror("calloc");
+		return 1;
+	}
+
+	for(unsigned int i = 0; i < cfg.threads; i++){
+		workers[i].cfg = &cfg;
+		workers[i].fd = shared_fd;
+
+		if(shared_fd < 0){
+			workers[i].fd = open(cfg.path, O_RDWR);
+			if(workers[i].fd < 0){
+				perror(cfg.path);
+				return 1;
+			}
+		}
+	}
+
+	start = now_ns();
+
+	for(unsigned int i = 0; i < cfg.threads; i++){
+		if(pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])){
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	sleep(cfg.seconds);
+	atomic_store(&stop, true);
+
+	for(unsigned int i = 0; i < cfg.threads; i++){
+		struct worker *w = &workers[i];
+
+		pthread_join(w->thread, NULL);
+
+		if(w->err){
+			fprintf(stderr, "thread %u: %s\n", i, strerror(-w->err));
+			ret = 1;
+		}
+
+		answers += w->answers;
+		syscalls += w->syscalls;
+		for(unsigned int b = 0; b < HIST_BUCKETS; b++)
+			hist[b] += w->hist[b];
+
+		if(shared_fd < 0)
+			close(w->fd);
+	}
+
+	elapsed = now_ns() - start;
+
+	if(shared_fd >= 0)
+		close(shared_fd);
+
+	printf("mode=%s threads=%u", mode_names[cfg.mode], cfg.threads);
+	if(cfg.mode == MODE_BATCH || cfg.mode == MODE_RING)
+		printf(" batch=%u", cfg.batch);
+	printf("\n");
+
+	printf("answers=%lu ops/sec=%.0f syscalls/answer=%.3f\n", answers,
+	       answers * 1e9 / elapsed, answers ? (double)syscalls / answers : 0.0);
+
+	/* Batch and ring latencies are per call, not per question */
+	printf("latency per call: p50<=%lluns p99<=%lluns p999<=%lluns\n",
+	       (unsigned long long)hist_percentile(hist, 50),
+	       (unsigned long long)hist_percentile(hist, 99),
+	       (unsigned long long)hist_percentile(hist, 99.9));
+
+	free(workers);
+	return ret;
+}